@@ -1,563 +1,4690 @@
 #include <iostream>
-#include <fstream>
 #include <string>
-#include <sstream>
 #include <vector>
 #include <unordered_map>
 #include <thread>
 #include <queue>
+#include <memory>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <chrono>
 #include <ctime>
-#include <iomanip>
-#include <sstream>
 #include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <map>
+#include <set>
+#include <functional>
+#include <string_view>
+#include <deque>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <charconv>
+#include <random>
+#include <cmath>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <intrin.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 using namespace std;
-mutex mtx;
 
 
-////////////////////////////////////////////// ORDER CLASS //////////////////////////////////////////////////////
-class Order {
+//////////////////////////////////////////// ARENA ////////////////////////////////////////////////////////////////
+// small objects of one owner (table entries, price levels) are cut from big blocks, a freed object goes to the
+// free list of its size and is reused by the next allocation of that size. Memory goes back to the system when
+// the arena dies. Not thread safe, the owner does the locking
+class Arena {
 public:
-    string customer_id;
-    string instrument;
-    string side;
-    string quantity;
-    string price;
-    string order_id;
-    string exec_status; // New, Fill, PFill, Reject
-    string timestamp;
-    string reason; // reason for reject
-    string order_flow; // use for make the correct ordering
-
-    // Constructor
-    Order(vector<string>& row) {
-        order_flow = row[0];
-        customer_id = row[1];
-        instrument = row[2];
-        side = row[3];
-        quantity = row[4];
-        price = row[5];
-    };
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
 
-    bool isBuy() {
-        return this->side == "1";
+    void* allocate(size_t size) {
+        if (size > MAX_SIZE) {
+            return ::operator new(size);
+        }
+        size_t slot = (size + ALIGN - 1) / ALIGN;
+        if (this->free_lists[slot] != nullptr) {
+            FreeSlot* reused = this->free_lists[slot];
+            this->free_lists[slot] = reused->next;
+            return reused;
+        }
+        if (this->used + slot * ALIGN > BLOCK_SIZE) {
+            this->blocks.emplace_back(new char[BLOCK_SIZE]);
+            this->used = 0;
+        }
+        void* fresh = this->blocks.back().get() + this->used;
+        this->used += slot * ALIGN;
+        return fresh;
     }
 
-    //----------------------------------- ADD A ORDER TO THE UNORDERED MAP----------------------------------
-    void addToMap(unordered_map<string, vector<Order>>& order_map, string group) {
-        order_map[group].push_back(*this);
+    void deallocate(void* pointer, size_t size) {
+        if (size > MAX_SIZE) {
+            ::operator delete(pointer);
+            return;
+        }
+        size_t slot = (size + ALIGN - 1) / ALIGN;
+        this->free_lists[slot] = new (pointer) FreeSlot{ this->free_lists[slot] };
     }
-};
-////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+private:
+    static const size_t ALIGN = alignof(max_align_t); // new char[] gives this alignment, sizes are rounded to it
+    static const size_t MAX_SIZE = 256;
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    struct FreeSlot {
+        FreeSlot* next;
+    };
 
-//---------------------------FUNCTION FOR PRIORITY QUEUE----------------------------------------------------
-struct CompareVectors {
-    bool operator()(const Order& a, const Order& b) const {
-        return stof(a.order_flow) > stof(b.order_flow);  // greater-than comparison for min-heap behavior
-    }
+    vector<unique_ptr<char[]>> blocks;
+    size_t used = BLOCK_SIZE; // bytes taken from the last block
+    FreeSlot* free_lists[MAX_SIZE / ALIGN + 1] = {};
 };
 
-//------------------------------MAKING THE TIME-STAMP-------------------------------------------------------
-string getCurrentTimestamp() {
-    // Get the current time
-    auto now = chrono::system_clock::now();
-    time_t time = chrono::system_clock::to_time_t(now);
+// lets the standard containers take their nodes from an arena, arrays (hash buckets) still use the heap
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
 
-    // Convert time to struct tm
-    struct tm timeInfo;
-    try { // survive from unexpected localtime_s function errors
-        localtime_s(&timeInfo, &time);
+    T* allocate(size_t n) {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(this->arena->allocate(sizeof(T)));
+    }
+
+    void deallocate(T* pointer, size_t n) {
+        if (n != 1) {
+            ::operator delete(pointer);
+            return;
+        }
+        this->arena->deallocate(pointer, sizeof(T));
     }
-    catch (const exception& e) {
-        return "Error getting timestamp";
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return this->arena == other.arena;
     }
 
-    // Format the timestamp
-    stringstream ss;
-    ss << put_time(&timeInfo, "%Y%m%d-%H%M%S")
-        << '.' << chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const {
+        return this->arena != other.arena;
+    }
 
-    return ss.str();
-}
+private:
+    template <typename U> friend class ArenaAllocator;
+    Arena* arena;
+};
 
 
 
-///////////////////////////////////////// ORDER BOOK CLASS //////////////////////////////////////////////////
-class OrderBook {
+//////////////////////////////////////////// SYMBOL TABLE ////////////////////////////////////////////////////////
+// maps names (instruments, client order ids) to small integer ids, so orders don't carry strings around
+// lookups take a string_view, so a field can be looked up straight from the input buffer without a copy
+class SymbolTable {
 public:
-    string instrument;
-    vector<Order> buy_orders; // decending order
-    vector<Order> sell_orders; // ascending order
+    // returns the id of the name, adds it to the table if it is not there yet. Every call counts as one user
+    // of the name for release
+    uint32_t intern(string_view name) {
+        auto it = this->ids.find(name);
+        if (it != this->ids.end()) {
+            this->users[it->second]++;
+            return it->second;
+        }
+        uint32_t id;
+        if (!this->free_ids.empty()) { // reuse the slot of a released name
+            id = this->free_ids.back();
+            this->free_ids.pop_back();
+            this->names[id] = string(name);
+            this->users[id] = 1;
+        }
+        else {
+            id = (uint32_t)this->names.size();
+            this->names.emplace_back(name);
+            this->users.push_back(1);
+        }
+        this->ids.emplace(this->names[id], id); // the key views the stored copy
+        return id;
+    }
 
-    // Constructor
-    OrderBook(string instrument) {
-        this->instrument = instrument;
+    // one user of the name is done with it, the name is dropped when nobody uses it anymore
+    void release(uint32_t id) {
+        if (--this->users[id] != 0) {
+            return;
+        }
+        this->ids.erase(this->names[id]);
+        string().swap(this->names[id]);
+        this->free_ids.push_back(id);
     }
 
-    //-------------------------------- ADD A SELL ORDER TO THE ORDER BOOK----------------------------------
-    void addSellArr(const Order order) {
-        float price = stof(order.price);
+    // returns false if the name is not in the table
+    bool find(string_view name, uint32_t& id) const {
+        auto it = this->ids.find(name);
+        if (it == this->ids.end()) {
+            return false;
+        }
+        id = it->second;
+        return true;
+    }
 
-        auto insertion_pos = upper_bound(this->sell_orders.begin(), this->sell_orders.end(), price,
-            [](float value, const Order ord) {
-                return value < stof(ord.price); // Compare based on price
-            }
-        );
+    const string& name(uint32_t id) const {
+        return this->names[id];
+    }
 
-        this->sell_orders.insert(insertion_pos, order);
+    size_t size() const {
+        return this->names.size();
     }
 
-    //-------------------------------- ADD A BUY ORDER TO THE ORDER BOOK-----------------------------------
-    void addBuyArr(const Order order) {
-        float price = stof(order.price);
+    // drop every name, the memory of the map stays in the arena for the next names
+    void clear() {
+        this->ids.clear();
+        this->names.clear();
+        this->users.clear();
+        this->free_ids.clear();
+    }
 
-        auto insertion_pos = upper_bound(this->buy_orders.begin(), this->buy_orders.end(), price,
-            [](float value, const Order ord) {
-                return value > stof(ord.price); // Compare based on price
-            }
-        );
+private:
+    Arena arena; // nodes of ids, declared first so it outlives the map
+    unordered_map<string_view, uint32_t, hash<string_view>, equal_to<string_view>,
+        ArenaAllocator<pair<const string_view, uint32_t>>> ids{ 0, hash<string_view>(), equal_to<string_view>(),
+        ArenaAllocator<pair<const string_view, uint32_t>>(arena) };
+    deque<string> names; // deque never moves the stored strings
+    deque<uint32_t> users; // number of intern calls not released yet
+    vector<uint32_t> free_ids;
+};
 
-        this->buy_orders.insert(insertion_pos, order);
+// symbol table that the reader threads intern into at the same time. The names are spread over stripes by
+// hash and each stripe has its own lock, the low bits of an id tell the stripe
+class SharedSymbolTable {
+public:
+    uint32_t intern(string_view name) {
+        uint32_t stripe = (uint32_t)(hash<string_view>()(name) % STRIPES);
+        lock_guard<mutex> lock(this->stripes[stripe].mtx);
+        return (this->stripes[stripe].table.intern(name) << STRIPE_BITS) | stripe;
     }
 
-    // Print the order book
-    void print() {
-        cout << "Instrument: " << instrument << endl;
-        cout << "Buy orders: " << endl;
-        for (Order& order : buy_orders) {
-            cout << order.order_id << " " << order.price << endl;
-        }
-        cout << "Sell orders: " << endl;
-        for (Order& order : sell_orders) {
-            cout << order.order_id << " " << order.price << endl;
+    void release(uint32_t id) {
+        Stripe& stripe = this->stripes[id % STRIPES];
+        lock_guard<mutex> lock(stripe.mtx);
+        stripe.table.release(id >> STRIPE_BITS);
+    }
+
+    // the reference stays valid until the name is released, stored names never move
+    const string& name(uint32_t id) {
+        Stripe& stripe = this->stripes[id % STRIPES];
+        lock_guard<mutex> lock(stripe.mtx);
+        return stripe.table.name(id >> STRIPE_BITS);
+    }
+
+    // drop every name, nobody may hold an id anymore
+    void clear() {
+        for (Stripe& stripe : this->stripes) {
+            lock_guard<mutex> lock(stripe.mtx);
+            stripe.table.clear();
         }
     }
+
+private:
+    static const int STRIPE_BITS = 6;
+    static const uint32_t STRIPES = 1 << STRIPE_BITS;
+
+    struct alignas(64) Stripe {
+        mutex mtx;
+        SymbolTable table;
+    };
+    Stripe stripes[STRIPES];
 };
 
+SymbolTable instruments; // the tradable flowers, filled before any thread starts
+SharedSymbolTable clients; // client order ids
 
+// raw text of a rejected row, the report echoes back exactly what the client sent. The client order id of a
+// rejected row is kept here instead of being interned
+struct RejectedRow {
+    string client;
+    string instrument;
+    string side;
+    string quantity;
+    string price;
+    string type; // empty when the row had no sixth column
+};
 
-///////////////////////////////////////////// CSV CLASS /////////////////////////////////////////////////////////
-class CSV {
+// rejected rows of all the reader threads, rejects are rare so one lock is enough
+class RejectedRowTable {
 public:
-    // Constructor
-    CSV(const string& filename) : filename(filename) {}
-
-    //----------------------------------- READ THE CSV FILE-----------------------------------------------------
-    void readCsv(unordered_map<string, vector<Order>>& order_map) {
-        ifstream inputFile(filename);
-        if (!inputFile.is_open()) {
-            cerr << "Error opening file." << endl;
-            return;
+    uint32_t add(RejectedRow row) {
+        lock_guard<mutex> lock(this->mtx);
+        if (!this->free_rows.empty()) {
+            uint32_t index = this->free_rows.back();
+            this->free_rows.pop_back();
+            this->rows[index] = move(row);
+            return index;
         }
+        this->rows.push_back(move(row));
+        return (uint32_t)this->rows.size() - 1;
+    }
 
-        string line;
-        int count = 0;
-        getline(inputFile, line); // Skip the first line (header)
-        while (getline(inputFile, line)) {
-            istringstream lineStream(line);
-            int column_number = 0; // count the number of columns in a row
-            string field;
-            int error_code = 200; // 200 means no error
-            vector<string> row = { to_string(++count) };
-
-            while (getline(lineStream, field, ',')) {
-                if (column_number > 4) break; // columns should be 5
-                if (error_code == 200) {
-                    error_code = isRejected(field, column_number);
-                }
-                row.push_back(field); // Store each field
-                column_number++;
+    // adds the rows of a whole block under one lock, indexes gets the index of each row
+    void addAll(vector<RejectedRow>& rows, uint32_t* indexes) {
+        lock_guard<mutex> lock(this->mtx);
+        for (size_t i = 0; i < rows.size(); i++) {
+            if (!this->free_rows.empty()) {
+                indexes[i] = this->free_rows.back();
+                this->free_rows.pop_back();
+                this->rows[indexes[i]] = move(rows[i]);
             }
-
-            if (row.size() != 1) {
-                Order order(row);
-                // classify the orders into rejected and accepted according to the error code
-                classifyOrders(order_map, order, error_code);
+            else {
+                indexes[i] = (uint32_t)this->rows.size();
+                this->rows.push_back(move(rows[i]));
             }
         }
+    }
 
-        inputFile.close(); // Close the file
+    const RejectedRow& operator[](uint32_t index) {
+        lock_guard<mutex> lock(this->mtx);
+        return this->rows[index];
     }
 
-    //----------------------------------- WRITE TO THE CSV FILE-----------------------------------------------------
-    void writeToCsv(priority_queue<Order, vector<Order>, CompareVectors> trade_queue) {
-        ofstream outputFile(filename);
-        if (!outputFile.is_open()) {
-            cerr << "Error opening output file." << endl;
-            return;
-        }
+    // the report of the row is written, its slot can be reused
+    void release(uint32_t index) {
+        lock_guard<mutex> lock(this->mtx);
+        this->rows[index] = RejectedRow();
+        this->free_rows.push_back(index);
+    }
 
-        // adds the header row first
-        vector<string> trade_arr = { "Order ID", "Client Order ID", "Instrument", "Side",
-                                        "Exec Status", "Quantity", "Price", "Transaction Time", "Reason" }; // header
-        for (size_t i = 0; i < trade_arr.size(); ++i) {
-            outputFile << trade_arr[i];
-            if (i < trade_arr.size() - 1) {
-                outputFile << ",";
-            }
-        }
-        outputFile << endl;
+    // drop every row, nobody may hold an index anymore
+    void clear() {
+        lock_guard<mutex> lock(this->mtx);
+        this->rows.clear();
+        this->free_rows.clear();
+    }
 
-        // Write each Order object as a CSV row
-        while (!trade_queue.empty()) {
-            Order top_order = trade_queue.top();
-            trade_queue.pop();
-            outputFile
-                << top_order.order_id << ","
-                << top_order.customer_id << ","
-                << top_order.instrument << ","
-                << top_order.side << ","
-                << top_order.exec_status << ","
-                << top_order.quantity << ","
-                << top_order.price << ","
-                << top_order.timestamp << ","
-                << top_order.reason << "," << endl;
-        }
+private:
+    mutex mtx;
+    deque<RejectedRow> rows; // deque never moves the stored rows
+    vector<uint32_t> free_rows;
+};
+RejectedRowTable rejected_rows;
 
-        // Close the output file
-        outputFile.close();
 
-        cout << "CSV file created successfully." << endl;
-    }
+//------------------------------FIXED-POINT PRICES AND QUANTITIES-------------------------------------------
+const int64_t PRICE_SCALE = 10000; // prices are kept as integer ten-thousandths
+const int PRICE_DECIMALS = 4;
 
-private:
-    string filename;
+// parse a decimal price like "55", "2.77" or ".5" into fixed-point, returns false if it is not a number
+bool parsePrice(string_view field, int64_t& price) {
+    size_t i = 0;
+    bool negative = false;
+    if (i < field.size() && (field[i] == '-' || field[i] == '+')) {
+        negative = field[i] == '-';
+        i++;
+    }
 
-    //----------------------------------- CLASSIFY THE ORDERS AND ADDS THE REASON -----------------------------------------------------
-    void classifyOrders(unordered_map<string, vector<Order>>& order_map, Order& order, int error_code) {
-        string flowerName = order.instrument;
-        if (error_code == 200) { // if everything OK
-            order.reason = "";
-            order.addToMap(order_map, flowerName);
+    int64_t value = 0;
+    int digits = 0;
+    for (; i < field.size() && field[i] >= '0' && field[i] <= '9'; i++, digits++) {
+        if (value > (INT64_MAX / PRICE_SCALE) / 10) {
+            return false; // too large
         }
-        else { // error occured
-            if (error_code == 400) {
-                order.reason = "Missing field";
-            }
-            else if (error_code == 401) {
-                order.reason = "Invalid instrument";
-            }
-            else if (error_code == 402) {
-                order.reason = "Invalid side";
-            }
-            else if (error_code == 403) {
-                order.reason = "Invalid quantity";
-            }
-            else if (error_code == 404) {
-                order.reason = "Invalid price";
-            }
-            order.exec_status = "Reject";
-            order.addToMap(order_map, "Rejected");
+        value = value * 10 + (field[i] - '0');
+    }
+    value *= PRICE_SCALE;
+
+    if (i < field.size() && field[i] == '.') {
+        i++;
+        int64_t unit = PRICE_SCALE / 10;
+        for (; i < field.size() && field[i] >= '0' && field[i] <= '9'; i++, digits++) {
+            value += (field[i] - '0') * unit; // digits beyond PRICE_DECIMALS are dropped
+            unit /= 10;
         }
     }
 
-    //----------------------------------- CHECK THE REQUIREMENTS OF A ORDER -----------------------------------------------------
-    int isRejected(string field, int column_number) {
-        float price;
-        int quantity;
+    if (digits == 0 || i != field.size()) {
+        return false;
+    }
+    price = negative ? -value : value;
+    return true;
+}
 
-        // Check if any required field is missing
-        if (field.empty()) {
-            return 400;
-        }
+// parse an integer quantity, returns false if it is not a number
+bool parseQuantity(string_view field, int32_t& quantity) {
+    size_t i = 0;
+    bool negative = false;
+    if (i < field.size() && (field[i] == '-' || field[i] == '+')) {
+        negative = field[i] == '-';
+        i++;
+    }
+    if (i == field.size()) {
+        return false;
+    }
 
-        if (column_number == 1) { // instrument column
-            if (field != "Rose" && field != "Lavender" && field != "Lotus" && field != "Tulip" && field != "Orchid") {
-                return 401;
-            }
-        }
-        else if (column_number == 2) { // buy sell column
-            if (field != "1" && field != "2") {
-                return 402;
-            }
-        }
-        else if (column_number == 3) { // quantity column
-            try {
-                quantity = stoi(field);
-            }
-            catch (...) {
-                return 403;
-            }
-            if (quantity % 10 != 0 || quantity >= 1000) {
-                return 403;
-            }
-        }
-        else if (column_number == 4) { // price column
-            try {
-                price = stof(field);
-            }
-            catch (...) {
-                return 404;
-            }
-            if (price <= 0.0) {
-                return 404;
-            }
+    int64_t value = 0;
+    for (; i < field.size(); i++) {
+        if (field[i] < '0' || field[i] > '9' || value > INT32_MAX) {
+            return false;
         }
+        value = value * 10 + (field[i] - '0');
+    }
+    if (value > INT32_MAX) {
+        return false;
+    }
+    quantity = (int32_t)(negative ? -value : value);
+    return true;
+}
 
-        return 200; // if everything OK
+// write a fixed-point price as text without trailing zeros, 550000 -> "55", 27700 -> "2.77". Needs at most
+// 21 chars, returns the end of the text
+char* writePrice(char* out, int64_t price) {
+    uint64_t value = price < 0 ? 0 - (uint64_t)price : (uint64_t)price;
+    if (price < 0) {
+        *out++ = '-';
     }
-};
+    out = to_chars(out, out + 20, value / PRICE_SCALE).ptr;
 
+    uint64_t fraction = value % PRICE_SCALE;
+    if (fraction != 0) {
+        *out++ = '.';
+        for (uint64_t unit = PRICE_SCALE / 10; fraction != 0; unit /= 10) { // stop at the last non zero digit
+            *out++ = (char)('0' + fraction / unit);
+            fraction %= unit;
+        }
+    }
+    return out;
+}
 
+string formatPrice(int64_t price) {
+    char text[24];
+    return string(text, writePrice(text, price));
+}
 
 
-/////////////////////////////////////////////////// TRADE CLASS ////////////////////////////////////////////////////////////////
-class Trade {
+////////////////////////////////////////////// ORDER CLASS //////////////////////////////////////////////////////
+// the order flow number orders the reports: the input sequence is in the high 32 bits and the low 32 bits count
+// the reports made by the same input order, so ordering is an exact integer comparison at any file size
+const int SUB_SEQUENCE_BITS = 32;
+
+uint64_t makeOrderFlow(uint32_t input_sequence) {
+    return (uint64_t)input_sequence << SUB_SEQUENCE_BITS;
+}
+
+enum class Side : uint8_t { Buy = 1, Sell = 2 };
+enum class ExecStatus : uint8_t { New, Reject, Fill, PFill, Cancelled, Replaced };
+enum class OrderType : uint8_t { New, Cancel, Amend }; // optional sixth column: empty or N, C, A
+const uint32_t NO_RAW = UINT32_MAX; // raw_row of an order rejected by the matching, its typed fields are echoed
+const uint32_t NO_CLIENT = UINT32_MAX; // customer_id of a row rejected by the validation, see RejectedRow::client
+
+// plain record without strings, it is copied around freely in the matching engine
+class Order {
 public:
-    priority_queue<Order, vector<Order>, CompareVectors> trade_queue;
-    unordered_map<string, vector<Order>> order_map;
+    uint64_t order_flow; // use for make the correct ordering, { input sequence, sub-sequence } see makeOrderFlow
+    int64_t price; // fixed-point, see PRICE_SCALE
+    int64_t timestamp; // transaction time in microseconds since epoch
+    uint32_t order_id; // row number in the input file, printed as "ord<order_id>"
+    uint32_t customer_id; // interned client order id, NO_CLIENT for a row rejected by the validation
+    uint32_t raw_row; // index into rejected_rows, only for rejected orders
+    int32_t quantity;
+    uint16_t instrument; // interned instrument
+    uint16_t reason; // error code for reject, 200 means no error
+    Side side;
+    ExecStatus exec_status;
+    OrderType type; // a cancel or amend names the open order by its client order id
 
-    //----------------------------------- INSERT A ORDER TO THE PRIORITY QUEUE----------------------------------
-    void insertTradeHeap(Order order, string exec_status, string order_flow, string timestamp) {
-        lock_guard<mutex> lock(mtx); // lock the thread until one thread is done
-        order.exec_status = exec_status;
-        order.timestamp = timestamp;
-        order.order_flow = order_flow;
+    Order() = default;
 
-        // rejected orders already has a reason
-        if (exec_status != "Reject") {
-            order.reason = ""; // reason
-        }
-        this->trade_queue.push(order);
-        return;
+    // Constructor, the typed fields are filled in by the validation of the row
+    Order(uint32_t order_id, uint32_t customer_id) {
+        this->order_flow = makeOrderFlow(order_id);
+        this->order_id = order_id;
+        this->customer_id = customer_id;
+        raw_row = 0;
+        quantity = 0;
+        price = 0;
+        timestamp = 0;
+        instrument = 0;
+        reason = 200;
+        side = Side::Buy;
+        exec_status = ExecStatus::New;
+        type = OrderType::New;
+    };
+
+    bool isBuy() const {
+        return this->side == Side::Buy;
     }
+};
+static_assert(is_trivially_copyable<Order>::value, "Order must stay a plain record");
+
+const char* execStatusName(ExecStatus status) {
+    switch (status) {
+    case ExecStatus::New: return "New";
+    case ExecStatus::Reject: return "Reject";
+    case ExecStatus::Fill: return "Fill";
+    case ExecStatus::PFill: return "PFill";
+    case ExecStatus::Cancelled: return "Cancelled";
+    case ExecStatus::Replaced: return "Replaced";
+    }
+    return "";
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    //----------------------------------- EXECUTE THE ORDERS FOR A GIVEN FLOWER----------------------------------
-    void executeOrders(string flower) {
-        // read the orders for given flower
-        vector<Order> flower_rows = this->order_map[flower];
 
-        // order book for buy and sell side
-        OrderBook order_book(flower);
+//------------------------------MAKING THE TIME-STAMP-------------------------------------------------------
+// the matching engine only takes the clock reading, the text is made when the report is written
+int timestamp_digits = 3; // digits after the second, 3 for milliseconds or 6 for microseconds
 
-        // read the each element of flower orders
-        for (int i = 0; i < flower_rows.size(); i++) {
-            Order order = flower_rows[i]; // getting a row of a order
-            string timestamp;
-
-            // making the order id
-            string order_id = "ord";
-            order_id.append(order.order_flow);
-            order.order_id = order_id;
-
-            if (order.isBuy()) { // buy order
-                processBuyOrders(order_book, order);
-                if (order.quantity != "0") {
-                    order_book.addBuyArr(order); // decending order
-                }
+#ifdef CLOCK_REALTIME_COARSE
+clockid_t timestamp_clock = CLOCK_REALTIME;
 
-            }
-            else { // sell order
-                processSellOrders(order_book, order);
-                if (order.quantity != "0") {
-                    order_book.addSellArr(order); // ascending order
-                }
-            }
+// the coarse clock is read without going to the kernel, use it when it ticks fast enough for the timestamp digits
+void chooseTimestampClock() {
+    struct timespec resolution;
+    long needed = timestamp_digits >= 6 ? 1000 : 1000000; // nanoseconds
+    bool coarse = clock_getres(CLOCK_REALTIME_COARSE, &resolution) == 0 && resolution.tv_sec == 0 && resolution.tv_nsec <= needed;
+    timestamp_clock = coarse ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME;
+}
+
+int64_t getCurrentTimestamp() {
+    struct timespec now;
+    clock_gettime(timestamp_clock, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+#else
+void chooseTimestampClock() {
+}
+
+int64_t getCurrentTimestamp() {
+    auto now = chrono::system_clock::now();
+    return chrono::duration_cast<chrono::microseconds>(now.time_since_epoch()).count();
+}
+#endif
+
+// with logical time a report is stamped from the input row of its order instead of the clock: row n is n
+// milliseconds after the epoch. Every report then only depends on the input, so two runs with any number of
+// threads write the same bytes
+bool logical_time = false;
+
+int64_t getReportTimestamp(uint64_t order_flow) {
+    if (logical_time) {
+        return (int64_t)(order_flow >> SUB_SEQUENCE_BITS) * 1000;
+    }
+    return getCurrentTimestamp();
+}
+
+// formats timestamps as YYYYMMDD-HHMMSS.sss (or .ssssss). The date and time part only changes once a second,
+// so it is kept and only the fraction is written for every report
+class TimestampFormatter {
+public:
+    // Needs at most 23 chars, returns the end of the text
+    char* write(char* out, int64_t timestamp) {
+        int64_t second = timestamp / 1000000;
+        if (second != this->cached_second) {
+            this->cachePrefix(second);
         }
+        memcpy(out, this->prefix, sizeof(this->prefix));
+        out += sizeof(this->prefix);
+
+        int64_t fraction = timestamp % 1000000;
+        if (timestamp_digits < 6) {
+            fraction /= 1000;
+        }
+        for (int i = timestamp_digits < 6 ? 2 : 5; i >= 0; i--) { // fixed width, .5 is written as .005
+            out[i] = (char)('0' + fraction % 10);
+            fraction /= 10;
+        }
+        return out + (timestamp_digits < 6 ? 3 : 6);
     }
 
-    //----------------------------------- ADD THE REJECTED ORDERS TO THE PRIORITY QUEUE----------------------------------
-    void addRejectedOrders() {
-        vector<Order> rejected_orders = this->order_map["Rejected"];
-        for (int i = 0; i < rejected_orders.size(); i++) {
-            Order order = rejected_orders[i];
-            string timestamp;
+private:
+    int64_t cached_second = -1;
+    char prefix[16]; // "YYYYMMDD-HHMMSS."
 
-            // making the order id
-            string order_id = "ord";
-            order_id.append(order.order_flow);
-            order.order_id = order_id;
+    void cachePrefix(int64_t second) {
+        time_t time = (time_t)second;
 
-            timestamp = getCurrentTimestamp();
-            this->insertTradeHeap(order, "Reject", order.order_flow, timestamp);
+        // Convert time to struct tm, logical time is in UTC so the output does not depend on the time zone
+        struct tm timeInfo;
+#ifdef _WIN32
+        bool ok = (logical_time ? gmtime_s(&timeInfo, &time) : localtime_s(&timeInfo, &time)) == 0;
+#else
+        bool ok = (logical_time ? gmtime_r(&time, &timeInfo) : localtime_r(&time, &timeInfo)) != nullptr;
+#endif
+        if (!ok) {
+            memset(&timeInfo, 0, sizeof(timeInfo));
         }
+
+        char text[32];
+        snprintf(text, sizeof(text), "%04d%02d%02d-%02d%02d%02d.", (timeInfo.tm_year + 1900) % 10000, timeInfo.tm_mon + 1,
+            timeInfo.tm_mday, timeInfo.tm_hour, timeInfo.tm_min, timeInfo.tm_sec);
+        memcpy(this->prefix, text, sizeof(this->prefix));
+        this->cached_second = second;
     }
+};
 
-private:
-    //------------------------------------------------------ PROCESS THE BUY ORDERS---------------------------------------------------------
-    void processBuyOrders(OrderBook& order_book, Order& order) {
-        vector<Order>* sell_book = &order_book.sell_orders;
-        string timestamp;
-        float incrementor = 0.0001; // for make the correct ordering (if one order makes multiple trades, then the order flow number
-        // should be increment) 0.0001 is enough bcoz maximum quantity is 1000.
 
-        if (sell_book->size() == 0) { // there are nothing to sell
-            timestamp = getCurrentTimestamp();
-            this->insertTradeHeap(order, "New", order.order_flow, timestamp);
+
+///////////////////////////////////////// ORDER BOOK CLASS //////////////////////////////////////////////////
+const uint32_t NIL = UINT32_MAX; // end of an intrusive list
+
+// all resting orders at one price, oldest first
+struct PriceLevel {
+    uint32_t head = NIL;
+    uint32_t tail = NIL;
+    uint32_t count = 0;
+    int64_t quantity = 0; // of all the orders, for the market data
+};
+
+// a resting order, linked into the FIFO queue of its price level
+struct OrderNode {
+    Order order;
+    uint32_t prev;
+    uint32_t next;
+    PriceLevel* level; // map nodes never move, so a cancel finds the level without a lookup
+    uint32_t older; // resting orders of the same side with the same client order id, oldest first
+    uint32_t newer;
+};
+
+//-------------------------------- POOL OF ORDER NODES----------------------------------------------------
+// nodes are addressed by index so the storage can grow, released nodes are reused through a free list
+class OrderPool {
+public:
+    uint32_t allocate(const Order& order) {
+        uint32_t index;
+        if (this->free_head != NIL) {
+            index = this->free_head;
+            this->free_head = this->nodes[index].next;
         }
         else {
-            if (stof((*sell_book)[0].price) > stof(order.price)) { // sell price is greater than to buy price
-                timestamp = getCurrentTimestamp();
-                this->insertTradeHeap(order, "New", order.order_flow, timestamp);
-            }
-            else {
-                while (order.quantity != "0") { // quantity is not zero of the order
-                    if (sell_book->size() == 0) { // there are nothing to sell
-                        break;
-                    }
-                    if (stof((*sell_book)[0].price) > stof(order.price)) { // sell price is greater than to buy price
-                        break;
-                    }
-                    int sell_quantity = stoi((*sell_book)[0].quantity);
-                    int buy_quantity = stoi(order.quantity);
-                    string row_price = order.price;
-                    string sell_price = (*sell_book)[0].price;
-
-                    // update the transaction price of the order according to the order book
-                    order.price = sell_price;
-
-                    if (sell_quantity > buy_quantity) { // sell quantity is greater than buy quantity
-                        (*sell_book)[0].quantity = to_string(buy_quantity); // set the transaction quantity
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap(order, "Fill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor); // increment the order flow number for next row of the same order
-                        order.quantity = "0"; // set the quantity to zero in order
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap((*sell_book)[0], "PFill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor); // increment the order flow number for next row of the same order
-                        (*sell_book)[0].quantity = to_string(sell_quantity - buy_quantity); // remaining quantity adds to the order book
-                        break;
+            index = (uint32_t)this->nodes.size();
+            this->nodes.emplace_back();
+        }
+        this->nodes[index] = { order, NIL, NIL, nullptr, NIL, NIL };
+        return index;
+    }
 
-                    }
-                    else if (sell_quantity < buy_quantity) { // sell quantity is lesser than buy quantity
-                        order.quantity = to_string(sell_quantity); // set the transaction quantity
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap(order, "PFill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor); // increment the order flow number for next row of the same order
-                        order.price = row_price; // set the price to the original price for remaining items
-                        order.quantity = to_string(buy_quantity - sell_quantity); // remaining quantity adds to the order book 
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap((*sell_book)[0], "Fill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor); // increment the order flow number for next row of the same order
-                        sell_book->erase(sell_book->begin()); // remove the completed order from the order book
+    void release(uint32_t index) {
+        this->nodes[index].next = this->free_head;
+        this->free_head = index;
+    }
 
-                    }
-                    else { // sell quantity is equal to buy quantity
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap(order, "Fill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor); // increment the order flow number for next row of the same order
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap((*sell_book)[0], "Fill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor);
-                        sell_book->erase(sell_book->begin()); // remove the completed order from the order book
-                        order.quantity = "0"; //order completed, quantity is zero
-                        break;
-                    }
-                }
-            }
-        }
+    OrderNode& operator[](uint32_t index) {
+        return this->nodes[index];
     }
 
-    //------------------------------------------------------ PROCESS THE SELL ORDERS---------------------------------------------------------
-    void processSellOrders(OrderBook& order_book, Order& order) {
-        vector<Order>* buy_book = &order_book.buy_orders;
-        string timestamp;
-        float incrementor = 0.0001; // for make the correct ordering (if one order makes multiple trades, then the order flow number 
-        // should be increment) 0.0001 is enough bcoz maximum quantity is 1000.
-        if (buy_book->size() == 0) { // there are nothing to buy
-            timestamp = getCurrentTimestamp();
-            this->insertTradeHeap(order, "New", order.order_flow, timestamp);
-        }
-        else {
-            if ((*buy_book)[0].price < order.price) { // buy price is lesser than to sell price
-                timestamp = getCurrentTimestamp();
-                this->insertTradeHeap(order, "New", order.order_flow, timestamp);
-            }
-            else {
-                while (order.quantity != "0") { // order quantity is not zero
+    // release every node, the storage is kept
+    void clear() {
+        this->nodes.clear();
+        this->free_head = NIL;
+    }
 
-                    if (buy_book->size() == 0) { // there are nothing to buy
-                        break;
-                    }
-                    if ((*buy_book)[0].price < order.price) { // buy price is lesser than to sell price
-                        break;
-                    }
-                    int buy_quantity = stoi((*buy_book)[0].quantity);
-                    int sell_quantity = stoi(order.quantity);
-                    string row_price = order.price;
-                    string buy_price = (*buy_book)[0].price;
-
-                    // update the transaction price of the order according to the order book
-                    order.price = buy_price;
-
-                    if (buy_quantity > sell_quantity) { // buy quantity is greater than sell quantity
-                        (*buy_book)[0].quantity = to_string(sell_quantity); // set the transaction quantity
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap(order, "Fill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor); // increment the order flow number for next row of the same order
-                        order.quantity = "0"; // set the quantity to zero in order, order completed
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap((*buy_book)[0], "PFill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor); // increment the order flow number for next row of the same order
-                        (*buy_book)[0].quantity = to_string(buy_quantity - sell_quantity); // remaining quantity adds to the order book
-                        break;
+private:
+    vector<OrderNode> nodes;
+    uint32_t free_head = NIL;
+};
 
-                    }
-                    else if (buy_quantity < sell_quantity) { // buy quantity is lesser than sell quantity
-                        order.quantity = to_string(buy_quantity); // set the transaction quantity
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap(order, "PFill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor); // increment the order flow number for next row of the same order
-                        order.price = row_price; // set the price to the original price for remaining items
-                        order.quantity = to_string(sell_quantity - buy_quantity); // remaining quantity adds to the order book
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap((*buy_book)[0], "Fill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor); // increment the order flow number for next row of the same order
-                        buy_book->erase(buy_book->begin()); // remove the completed order from the order book
+//-------------------------------- INDEX OF THE OPEN ORDERS----------------------------------------------
+// client order id -> book node, open addressing with linear probing in one flat array. An erase shifts the
+// entries after it back, so there are no tombstones and a lookup stays short however many orders come and go
+class OrderIndex {
+public:
+    OrderIndex() : slots(16, { EMPTY, NIL }), mask(15), shift(60) {}
 
-                    }
-                    else { // buy quantity is equal to sell quantity
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap(order, "Fill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor); // increment the order flow number for next row of the same order
-                        timestamp = getCurrentTimestamp();
-                        this->insertTradeHeap((*buy_book)[0], "Fill", order.order_flow, timestamp);
-                        order.order_flow = to_string(stof(order.order_flow) + incrementor);
-                        buy_book->erase(buy_book->begin()); // remove the completed order from the order book
-                        order.quantity = "0"; //order completed, quantity is zero
-                        break;
-                    }
-                }
+    // node of the key, NIL if there is none
+    uint32_t find(uint32_t key) const {
+        for (size_t i = this->home(key);; i = (i + 1) & this->mask) {
+            if (this->slots[i].key == key) {
+                return this->slots[i].value;
+            }
+            if (this->slots[i].key == EMPTY) {
+                return NIL;
             }
         }
     }
 
-};
+    // a key already in the index points to the new node
+    void insert(uint32_t key, uint32_t value) {
+        if ((this->count + 1) * 2 > this->slots.size()) {
+            this->grow();
+        }
+        size_t i = this->home(key);
+        while (this->slots[i].key != EMPTY && this->slots[i].key != key) {
+            i = (i + 1) & this->mask;
+        }
+        this->count += this->slots[i].key == EMPTY;
+        this->slots[i] = { key, value };
+    }
+
+    // erase the key only if it still points to value
+    void erase(uint32_t key, uint32_t value) {
+        size_t i = this->home(key);
+        while (this->slots[i].key != key) {
+            if (this->slots[i].key == EMPTY) {
+                return;
+            }
+            i = (i + 1) & this->mask;
+        }
+        if (this->slots[i].value != value) {
+            return;
+        }
+        this->count--;
+        for (size_t j = (i + 1) & this->mask; this->slots[j].key != EMPTY; j = (j + 1) & this->mask) {
+            size_t k = this->home(this->slots[j].key);
+            bool movable = i <= j ? (k <= i || k > j) : (k <= i && k > j); // the hole is between k and j
+            if (movable) {
+                this->slots[i] = this->slots[j];
+                i = j;
+            }
+        }
+        this->slots[i] = { EMPTY, NIL };
+    }
 
+    // erase every key, the table keeps its size
+    void clear() {
+        fill(this->slots.begin(), this->slots.end(), Slot{ EMPTY, NIL });
+        this->count = 0;
+    }
 
+private:
+    static const uint32_t EMPTY = UINT32_MAX;
 
+    struct Slot {
+        uint32_t key;
+        uint32_t value;
+    };
 
-////////////////////////////////////////////// MAIN FUNCTION /////////////////////////////////////////////////////////////////
-int main() {
+    vector<Slot> slots;
+    size_t mask;
+    int shift; // 64 - log2 of the size
+    size_t count = 0;
 
-    Trade trade;
+    size_t home(uint32_t key) const {
+        return (size_t)((key * 0x9E3779B97F4A7C15ull) >> this->shift);
+    }
 
-    // read the csv file and store the orders in unordered map flower_fields
-    CSV read_file("ex2.csv");
-    read_file.readCsv(trade.order_map);
+    void grow() {
+        vector<Slot> old(this->slots.size() * 2, { EMPTY, NIL });
+        old.swap(this->slots);
+        this->mask = this->slots.size() - 1;
+        this->shift--;
+        this->count = 0;
+        for (const Slot& slot : old) {
+            if (slot.key != EMPTY) {
+                this->insert(slot.key, slot.value);
+            }
+        }
+    }
+};
 
+//-------------------------------- ONE SIDE OF THE ORDER BOOK----------------------------------------------
+// Compare orders the prices from the best to the worst, the best level is cached
+template <typename Compare>
+class BookSide {
+public:
+    bool empty() const {
+        return this->best == nullptr;
+    }
 
-    // threads for each flower and rejected orders
-    const int num_threads = 6;
-    thread threads[num_threads];
+    // price of the best level, only valid when the side is not empty
+    int64_t bestPrice() const {
+        return this->best_price;
+    }
 
-    string flowers[] = { "Rose", "Lavender", "Lotus", "Tulip", "Orchid" };
-    for (int i = 0; i < num_threads - 1; i++) {
-        threads[i] = thread(&Trade::executeOrders, &trade, flowers[i]);
+    // the oldest order at the best price
+    Order& front(OrderPool& pool) {
+        return pool[this->best->head].order;
     }
-    threads[5] = thread(&Trade::addRejectedOrders, &trade);
 
-    // wait until threads are completed
-    for (int i = 0; i < num_threads; ++i) {
-        threads[i].join();
+    uint32_t frontIndex() const {
+        return this->best->head;
     }
 
-    // making the final csv file
-    CSV write_file("execution_rep.csv");
-    write_file.writeToCsv(trade.trade_queue);
+    // add an order at the back of its price level, O(log levels) for a new level and O(1) otherwise. Returns its node
+    uint32_t push(OrderPool& pool, const Order& order) {
+        uint32_t index = pool.allocate(order);
+        PriceLevel& level = this->levels[order.price];
+        pool[index].level = &level;
+        if (level.tail == NIL) {
+            level.head = index;
+        }
+        else {
+            pool[level.tail].next = index;
+            pool[index].prev = level.tail;
+        }
+        level.tail = index;
+        level.count++;
+        level.quantity += order.quantity;
+        this->count++;
+        this->noteChange(order.price);
 
-    return 0;
+        if (this->best == nullptr || Compare()(order.price, this->best_price)) {
+            this->best = &level;
+            this->best_price = order.price;
+        }
+        return index;
+    }
+
+    // take any resting order out, O(1) unless its level becomes empty
+    void remove(OrderPool& pool, uint32_t index) {
+        OrderNode& node = pool[index];
+        PriceLevel* level = node.level;
+        if (node.prev != NIL) {
+            pool[node.prev].next = node.next;
+        }
+        else {
+            level->head = node.next;
+        }
+        if (node.next != NIL) {
+            pool[node.next].prev = node.prev;
+        }
+        else {
+            level->tail = node.prev;
+        }
+        level->count--;
+        level->quantity -= node.order.quantity;
+        this->count--;
+        int64_t price = node.order.price;
+        this->noteChange(price);
+        pool.release(index);
+
+        if (level->count == 0) {
+            this->levels.erase(price);
+            if (level == this->best) {
+                this->updateBest();
+            }
+        }
+    }
+
+    // remove the oldest order at the best price
+    void popFront(OrderPool& pool) {
+        uint32_t index = this->best->head;
+        this->best->quantity -= pool[index].order.quantity;
+        this->noteChange(this->best_price);
+        this->best->head = pool[index].next;
+        if (this->best->head != NIL) {
+            pool[this->best->head].prev = NIL;
+        }
+        else {
+            this->best->tail = NIL;
+        }
+        this->best->count--;
+        this->count--;
+        pool.release(index);
+
+        if (this->best->count == 0) { // level is empty, the next one becomes the best
+            this->levels.erase(this->levels.begin());
+            this->updateBest();
+        }
+    }
+
+    // change the quantity of a resting order, it keeps its place
+    void setQuantity(OrderPool& pool, uint32_t index, int32_t quantity) {
+        OrderNode& node = pool[index];
+        node.level->quantity += quantity - node.order.quantity;
+        node.order.quantity = quantity;
+        this->noteChange(node.order.price);
+    }
+
+    // number of resting orders
+    size_t size() const {
+        return this->count;
+    }
+
+    size_t levelCount() const {
+        return this->levels.size();
+    }
+
+    // walk the resting orders from the best price to the worst
+    void forEach(OrderPool& pool, const function<void(const Order&)>& visit) {
+        for (auto& level : this->levels) {
+            for (uint32_t index = level.second.head; index != NIL; index = pool[index].next) {
+                visit(pool[index].order);
+            }
+        }
+    }
+
+    //-------------------------------- LEVELS FOR THE MARKET DATA-----------------------------------
+    // the level at price, nullptr if there is no order at that price
+    const PriceLevel* level(int64_t price) const {
+        auto it = this->levels.find(price);
+        return it == this->levels.end() ? nullptr : &it->second;
+    }
+
+    // the best level, nullptr if the side is empty
+    const PriceLevel* bestLevel() const {
+        return this->best;
+    }
+
+    // forget every order, the nodes of the levels go back to the arena. The nodes of the orders are in the pool
+    void clear() {
+        this->levels.clear();
+        this->best = nullptr;
+        this->count = 0;
+        this->changed.clear();
+    }
+
+    // with tracking on, the prices of the levels that changed are collected until they are taken. Orders put
+    // back from a snapshot count as changes too
+    void trackChanges() {
+        this->tracking = true;
+    }
+
+    // prices of the levels that changed since the last call, each once
+    vector<int64_t>& takeChanges() {
+        sort(this->changed.begin(), this->changed.end());
+        this->changed.erase(unique(this->changed.begin(), this->changed.end()), this->changed.end());
+        return this->changed;
+    }
+
+private:
+    Arena arena; // nodes of levels, a price level that comes and goes reuses the same node
+    map<int64_t, PriceLevel, Compare, ArenaAllocator<pair<const int64_t, PriceLevel>>> levels{
+        ArenaAllocator<pair<const int64_t, PriceLevel>>(arena) };
+    PriceLevel* best = nullptr;
+    int64_t best_price = 0;
+    size_t count = 0;
+    bool tracking = false;
+    vector<int64_t> changed; // prices of the levels changed, when tracking
+
+    void noteChange(int64_t price) {
+        if (this->tracking) {
+            this->changed.push_back(price);
+        }
+    }
+
+    void updateBest() {
+        if (this->levels.empty()) {
+            this->best = nullptr;
+            return;
+        }
+        this->best = &this->levels.begin()->second;
+        this->best_price = this->levels.begin()->first;
+    }
+};
+
+class OrderBook {
+public:
+    string instrument;
+    OrderPool pool; // nodes of both sides
+    BookSide<greater<int64_t>> buy_orders; // decending order
+    BookSide<less<int64_t>> sell_orders; // ascending order
+    OrderIndex open_buys; // client order id -> newest node of the side with it, for cancel and amend
+    OrderIndex open_sells;
+
+    // Constructor
+    OrderBook(string instrument) {
+        this->instrument = instrument;
+    }
+
+    //-------------------------------- ADD A SELL ORDER TO THE ORDER BOOK----------------------------------
+    void addSellOrder(const Order& order) {
+        this->link(this->open_sells, this->sell_orders.push(this->pool, order));
+    }
+
+    //-------------------------------- ADD A BUY ORDER TO THE ORDER BOOK-----------------------------------
+    void addBuyOrder(const Order& order) {
+        this->link(this->open_buys, this->buy_orders.push(this->pool, order));
+    }
+
+    //-------------------------------- REMOVE THE OLDEST ORDER AT THE BEST PRICE OF A SIDE-----------------------------------
+    template <typename BookSideT>
+    void popFront(BookSideT& side) {
+        this->unlink(side.frontIndex());
+        side.popFront(this->pool);
+    }
+
+    //-------------------------------- FIND AN OPEN ORDER-----------------------------------
+    // the open order with this client order id on this side, nullptr if there is none. When open orders of a
+    // side share a client order id the newest one is found, and the one before it once that one is gone
+    Order* find(uint32_t customer_id, Side side) {
+        uint32_t index = this->openOrders(side).find(customer_id);
+        return index == NIL ? nullptr : &this->pool[index].order;
+    }
+
+    //-------------------------------- CHANGE THE QUANTITY OF AN OPEN ORDER-----------------------------------
+    // order must come from find, it keeps its place in the queue
+    void setQuantity(const Order& order, int32_t quantity) {
+        uint32_t index = this->openOrders(order.side).find(order.customer_id);
+        if (order.isBuy()) {
+            this->buy_orders.setQuantity(this->pool, index, quantity);
+        }
+        else {
+            this->sell_orders.setQuantity(this->pool, index, quantity);
+        }
+    }
+
+    //-------------------------------- TAKE AN OPEN ORDER OUT OF THE BOOK-----------------------------------
+    // order must come from find
+    void remove(const Order& order) {
+        uint32_t index = this->openOrders(order.side).find(order.customer_id);
+        this->unlink(index);
+        if (order.isBuy()) {
+            this->buy_orders.remove(this->pool, index);
+        }
+        else {
+            this->sell_orders.remove(this->pool, index);
+        }
+    }
+
+    //-------------------------------- SAVE AND RESTORE THE RESTING ORDERS-----------------------------------
+    // every resting order of both sides
+    void forEachResting(const function<void(const Order&)>& visit) {
+        this->buy_orders.forEach(this->pool, visit);
+        this->sell_orders.forEach(this->pool, visit);
+    }
+
+    // puts a saved order back at the end of its price level. Orders come back in order flow order, which is
+    // the order they joined their levels and their client order id chains in
+    void restore(const Order& order) {
+        if (order.isBuy()) {
+            this->addBuyOrder(order);
+        }
+        else {
+            this->addSellOrder(order);
+        }
+    }
+
+    // empty the book for the next file, the memory is kept
+    void clear() {
+        this->buy_orders.clear();
+        this->sell_orders.clear();
+        this->pool.clear();
+        this->open_buys.clear();
+        this->open_sells.clear();
+    }
+
+    // Print the order book
+    void print() {
+        auto print_order = [](const Order& order) {
+            cout << "ord" << order.order_id << " " << formatPrice(order.price) << endl;
+        };
+        cout << "Instrument: " << instrument << endl;
+        cout << "Buy orders: " << endl;
+        buy_orders.forEach(pool, print_order);
+        cout << "Sell orders: " << endl;
+        sell_orders.forEach(pool, print_order);
+    }
+
+private:
+    OrderIndex& openOrders(Side side) {
+        return side == Side::Buy ? this->open_buys : this->open_sells;
+    }
+
+    // a new resting node becomes the newest of its client order id
+    void link(OrderIndex& open_orders, uint32_t index) {
+        OrderNode& node = this->pool[index];
+        node.older = open_orders.find(node.order.customer_id);
+        if (node.older != NIL) {
+            this->pool[node.older].newer = index;
+        }
+        open_orders.insert(node.order.customer_id, index);
+    }
+
+    // a node leaving the book, the index moves to the one before it when it was the newest
+    void unlink(uint32_t index) {
+        OrderNode& node = this->pool[index];
+        if (node.older != NIL) {
+            this->pool[node.older].newer = node.newer;
+        }
+        if (node.newer != NIL) {
+            this->pool[node.newer].older = node.older;
+        }
+        else if (node.older != NIL) {
+            this->openOrders(node.order.side).insert(node.order.customer_id, node.older);
+        }
+        else {
+            this->openOrders(node.order.side).erase(node.order.customer_id, index);
+        }
+    }
+};
+
+
+
+//////////////////////////////////////////// MARKET DATA /////////////////////////////////////////////////////////
+// after every order that changes a book, a Depth update for every price level it changed (L2), then a Top
+// update for each side whose best level changed (L1). The updates of an order carry its order flow, so the feed
+// is in input order like the reports. Written as csv, or as records of this layout after a FLOWBOOK header
+enum class MarketUpdateKind : uint8_t { Depth, Top };
+
+struct MarketUpdate {
+    uint64_t order_flow; // of the order that made the change
+    int64_t price; // fixed-point, not set for the Top of an empty side
+    int64_t quantity; // total resting at the level, 0 when the level is gone
+    uint32_t orders; // resting orders at the level
+    uint16_t instrument;
+    Side side;
+    MarketUpdateKind kind;
+};
+static_assert(sizeof(MarketUpdate) == 32, "market data layout changed");
+
+
+
+//////////////////////////////////////////// STATS ///////////////////////////////////////////////////////////////
+// counters and latency histograms of the stages. Every counter has a single writer (a thread, or the task of an
+// instrument) that bumps it with relaxed atomics, so nothing is locked on the hot path and a dump can read
+// them at any time. Build with -DNO_STATS to compile all of it out of the hot path
+#ifdef NO_STATS
+#define STAT(...)
+#else
+#define STAT(...) __VA_ARGS__
+#endif
+
+// latencies in nanoseconds. Below 16 every value has its own bucket, above that every power of two is cut in
+// 16 buckets, so a value is known within 1/16 and the whole range takes 976 counters. Reading the clock costs
+// about as much as a small stage, so only one event in SAMPLE_EVERY is timed
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 4;
+    static const size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+    static const uint32_t SAMPLE_EVERY = 16;
+
+    // start time of the event if it is one to time, 0 otherwise
+    int64_t start() {
+        return ++this->events % SAMPLE_EVERY == 0 ? now() : 0;
+    }
+
+    void stop(int64_t start_time) {
+        if (start_time != 0) {
+            this->record((uint64_t)(now() - start_time));
+        }
+    }
+
+    static int64_t now() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void record(uint64_t value) {
+        bump(this->counts[bucketOf(value)]);
+    }
+
+    void addTo(vector<uint64_t>& merged) const {
+        merged.resize(BUCKETS, 0);
+        for (size_t i = 0; i < BUCKETS; i++) {
+            merged[i] += this->counts[i].load(memory_order_relaxed);
+        }
+    }
+
+    // lowest value of the bucket
+    static uint64_t bucketValue(size_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        int exponent = (int)(bucket / SUB_BUCKETS) + SUB_BITS - 1;
+        return (SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - SUB_BITS);
+    }
+
+    // value below which the share p of the recorded values are
+    static uint64_t percentile(const vector<uint64_t>& merged, double p) {
+        uint64_t total = 0;
+        for (uint64_t count : merged) {
+            total += count;
+        }
+        uint64_t rank = (uint64_t)(p * total);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < merged.size(); i++) {
+            seen += merged[i];
+            if (seen > rank) {
+                return bucketValue(i);
+            }
+        }
+        return 0;
+    }
+
+    static void bump(atomic<uint64_t>& counter, uint64_t by = 1) { // single writer
+        counter.store(counter.load(memory_order_relaxed) + by, memory_order_relaxed);
+    }
+
+private:
+    atomic<uint64_t> counts[BUCKETS] = {};
+    uint32_t events = 0; // only the writer uses it
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return (size_t)value;
+        }
+        int exponent = highestBit(value);
+        size_t sub = (size_t)(value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    static int highestBit(uint64_t value) {
+#ifdef _MSC_VER
+        unsigned long bit;
+        _BitScanReverse64(&bit, value);
+        return (int)bit;
+#else
+        return 63 - __builtin_clzll(value);
+#endif
+    }
+};
+
+// stages of one thread
+struct ThreadStats {
+    LatencyHistogram parse; // split a row, per row of a block
+    LatencyHistogram validate; // check and convert the fields and intern the client, per row of a block
+    LatencyHistogram write; // format one report
+    atomic<uint64_t> rows{ 0 };
+    atomic<uint64_t> rejects[7] = {}; // by reason, 400..406
+};
+
+// matching of one instrument, written only by the task of the instrument
+struct InstrumentStats {
+    LatencyHistogram match; // one incoming order, with its fills
+    atomic<uint64_t> orders{ 0 };
+    atomic<uint64_t> reports[6] = {}; // by ExecStatus
+    atomic<uint64_t> resting_buys{ 0 };
+    atomic<uint64_t> resting_sells{ 0 };
+    atomic<uint64_t> levels{ 0 }; // price levels of both sides
+    atomic<uint64_t> max_resting{ 0 };
+};
+
+class Stats {
+public:
+    // stats of the calling thread, registered on first use. The stats of a thread that exited are handed to the
+    // next new one with their counts, so a run that starts threads for every file keeps a fixed number of them
+    ThreadStats& thread() {
+        static thread_local Lease lease;
+        if (lease.local == nullptr) {
+            lock_guard<mutex> lock(this->mtx);
+            if (!this->idle.empty()) {
+                lease.local = this->idle.back();
+                this->idle.pop_back();
+            }
+            else {
+                this->threads.emplace_back(new ThreadStats());
+                lease.local = this->threads.back().get();
+            }
+            lease.owner = this;
+        }
+        return *lease.local;
+    }
+
+    // the instruments must be known, before any matching starts. Each batch lane matches its own books, so an
+    // instrument has a set of stats per lane to keep one writer each, they are added up by dump
+    void setInstruments(size_t count, unsigned lanes = 1) {
+        this->instrument_stats.reset(new InstrumentStats[count * lanes]);
+        this->instrument_count = count;
+        this->lane_count = lanes;
+    }
+
+    InstrumentStats& instrument(uint16_t instrument, uint32_t lane) {
+        return this->instrument_stats[lane * this->instrument_count + instrument];
+    }
+
+    // book depth after an order is matched
+    template <typename Book>
+    void noteBook(uint16_t instrument, uint32_t lane, const Book& book) {
+        InstrumentStats& stats = this->instrument(instrument, lane);
+        uint64_t resting = book.buy_orders.size() + book.sell_orders.size();
+        stats.resting_buys.store(book.buy_orders.size(), memory_order_relaxed);
+        stats.resting_sells.store(book.sell_orders.size(), memory_order_relaxed);
+        stats.levels.store(book.buy_orders.levelCount() + book.sell_orders.levelCount(), memory_order_relaxed);
+        if (resting > stats.max_resting.load(memory_order_relaxed)) {
+            stats.max_resting.store(resting, memory_order_relaxed);
+        }
+    }
+
+    // SIGUSR1 asks for a dump, it is written by the next call of poll (the handler itself can't lock or print).
+    // Reads are not restarted, so a stream waiting on stdin gets to poll too
+    void installSignal() {
+#ifndef _WIN32
+        struct sigaction action = {};
+        action.sa_handler = [](int) { Stats::requested = 1; };
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, nullptr);
+#endif
+    }
+
+    void poll() {
+        if (Stats::requested) {
+            Stats::requested = 0;
+            this->dump(cerr);
+        }
+    }
+
+    void dump(ostream& out) {
+        vector<uint64_t> parse, validate, write, match;
+        uint64_t rows = 0;
+        uint64_t rejects[7] = {};
+        {
+            lock_guard<mutex> lock(this->mtx);
+            for (const auto& local : this->threads) {
+                local->parse.addTo(parse);
+                local->validate.addTo(validate);
+                local->write.addTo(write);
+                rows += local->rows.load(memory_order_relaxed);
+                for (int i = 0; i < 7; i++) {
+                    rejects[i] += local->rejects[i].load(memory_order_relaxed);
+                }
+            }
+        }
+
+        out << "---------------- stats ----------------\n";
+        out << "rows " << rows << "  rejected: missing field " << rejects[0] << ", instrument " << rejects[1]
+            << ", side " << rejects[2] << ", quantity " << rejects[3] << ", price " << rejects[4] << ", type " << rejects[6]
+            << ", unknown order " << rejects[5] << "\n";
+        out << "stage (ns)        p50      p90      p99     p999      max\n";
+        for (size_t i = 0; i < this->instrument_count * this->lane_count; i++) {
+            this->instrument_stats[i].match.addTo(match);
+        }
+        dumpStage(out, "parse", parse);
+        dumpStage(out, "validate", validate);
+        dumpStage(out, "match", match);
+        dumpStage(out, "write", write);
+
+        out << "instrument       orders      new     fill    pfill   cancel  replace   reject  resting buy/sell  levels  max resting  match p50/p99 (ns)\n";
+        for (size_t i = 0; i < this->instrument_count; i++) {
+            vector<uint64_t> latency;
+            uint64_t orders = 0, reports[6] = {}, resting_buys = 0, resting_sells = 0, levels = 0, max_resting = 0;
+            for (uint32_t lane = 0; lane < this->lane_count; lane++) {
+                InstrumentStats& stats = this->instrument((uint16_t)i, lane);
+                stats.match.addTo(latency);
+                orders += stats.orders.load(memory_order_relaxed);
+                for (int status = 0; status < 6; status++) {
+                    reports[status] += stats.reports[status].load(memory_order_relaxed);
+                }
+                resting_buys += stats.resting_buys.load(memory_order_relaxed);
+                resting_sells += stats.resting_sells.load(memory_order_relaxed);
+                levels += stats.levels.load(memory_order_relaxed);
+                max_resting = max(max_resting, stats.max_resting.load(memory_order_relaxed));
+            }
+            char line[256];
+            snprintf(line, sizeof(line), "%-12.12s %10llu %8llu %8llu %8llu %8llu %8llu %8llu  %8llu/%-8llu %6llu  %11llu  %llu/%llu\n",
+                instruments.name((uint32_t)i).c_str(),
+                (unsigned long long)orders,
+                (unsigned long long)reports[(int)ExecStatus::New],
+                (unsigned long long)reports[(int)ExecStatus::Fill],
+                (unsigned long long)reports[(int)ExecStatus::PFill],
+                (unsigned long long)reports[(int)ExecStatus::Cancelled],
+                (unsigned long long)reports[(int)ExecStatus::Replaced],
+                (unsigned long long)reports[(int)ExecStatus::Reject],
+                (unsigned long long)resting_buys,
+                (unsigned long long)resting_sells,
+                (unsigned long long)levels,
+                (unsigned long long)max_resting,
+                (unsigned long long)LatencyHistogram::percentile(latency, 0.5),
+                (unsigned long long)LatencyHistogram::percentile(latency, 0.99));
+            out << line;
+        }
+        out.flush();
+    }
+
+private:
+    mutex mtx; // guards the list of threads, taken once per thread and by dump
+    vector<unique_ptr<ThreadStats>> threads;
+    vector<ThreadStats*> idle; // of threads that exited
+
+    // gives the stats of a thread back when it exits
+    struct Lease {
+        Stats* owner = nullptr;
+        ThreadStats* local = nullptr;
+
+        ~Lease() {
+            if (this->local != nullptr) {
+                lock_guard<mutex> lock(this->owner->mtx);
+                this->owner->idle.push_back(this->local);
+            }
+        }
+    };
+    unique_ptr<InstrumentStats[]> instrument_stats;
+    size_t instrument_count = 0;
+    unsigned lane_count = 1;
+    static volatile sig_atomic_t requested;
+
+    static void dumpStage(ostream& out, const char* name, const vector<uint64_t>& merged) {
+        uint64_t max_value = 0;
+        for (size_t i = 0; i < merged.size(); i++) {
+            if (merged[i] != 0) {
+                max_value = LatencyHistogram::bucketValue(i);
+            }
+        }
+        char line[128];
+        snprintf(line, sizeof(line), "%-12s %8llu %8llu %8llu %8llu %8llu\n", name,
+            (unsigned long long)LatencyHistogram::percentile(merged, 0.5),
+            (unsigned long long)LatencyHistogram::percentile(merged, 0.9),
+            (unsigned long long)LatencyHistogram::percentile(merged, 0.99),
+            (unsigned long long)LatencyHistogram::percentile(merged, 0.999),
+            (unsigned long long)max_value);
+        out << line;
+    }
+};
+
+volatile sig_atomic_t Stats::requested = 0;
+Stats stats;
+
+
+
+//////////////////////////////////////////// THREAD PLACEMENT ////////////////////////////////////////////////////
+// the threads of each stage can be pinned to a list of cpus, they take the cpus of the list in turn. A matching
+// task has a home worker and only moves to workers on the same NUMA node, so the book memory it grows is first
+// touched, and placed, on that node. With busy polling the threads waiting for the previous stage spin instead
+// of sleeping, for runs with cores to spare
+struct ThreadPlacement {
+    vector<unsigned> ingest; // readers: split, validate and publish the chunks
+    vector<unsigned> match; // workers of the pool, and the thread of a stream
+    vector<unsigned> output; // report writers, then market data writers
+    bool busy_poll = false;
+};
+ThreadPlacement placement;
+
+// "0-3,8,10-11", false when it is not a list of cpus of this machine
+bool parseCpuList(string_view text, vector<unsigned>& cpus) {
+    cpus.clear();
+    unsigned cpu_count = max(1u, thread::hardware_concurrency());
+    while (!text.empty()) {
+        size_t comma = text.find(',');
+        string_view range = text.substr(0, comma);
+        text = comma == string_view::npos ? string_view() : text.substr(comma + 1);
+
+        size_t dash = range.find('-');
+        string_view low_text = range.substr(0, dash);
+        string_view high_text = dash == string_view::npos ? low_text : range.substr(dash + 1);
+        unsigned low = 0, high = 0;
+        if (low_text.empty() || high_text.empty()
+            || from_chars(low_text.data(), low_text.data() + low_text.size(), low).ptr != low_text.data() + low_text.size()
+            || from_chars(high_text.data(), high_text.data() + high_text.size(), high).ptr != high_text.data() + high_text.size()
+            || low > high || high >= cpu_count) {
+            return false;
+        }
+        for (unsigned cpu = low; cpu <= high; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return !cpus.empty();
+}
+
+// pins the calling thread to the index-th cpu of the list (in turn), nothing when the list is empty
+void pinThread(const vector<unsigned>& cpus, size_t index) {
+    if (cpus.empty()) {
+        return;
+    }
+    unsigned cpu = cpus[index % cpus.size()];
+#ifdef _WIN32
+    if (cpu < 64) {
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+    }
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// NUMA node of a cpu, 0 when it is not known
+int cpuNode(unsigned cpu) {
+#ifdef _WIN32
+    UCHAR node;
+    return cpu < 256 && GetNumaProcessorNode((UCHAR)cpu, &node) ? node : 0;
+#else
+    static const vector<int> nodes = [] { // node of every cpu, from sysfs
+        vector<int> nodes(max(1u, thread::hardware_concurrency()), 0);
+        error_code error;
+        for (const filesystem::directory_entry& entry : filesystem::directory_iterator("/sys/devices/system/node", error)) {
+            string name = entry.path().filename().string();
+            if (name.size() < 5 || name.compare(0, 4, "node") != 0 || !isdigit((unsigned char)name[4])) {
+                continue;
+            }
+            ifstream list(entry.path() / "cpulist");
+            string text;
+            vector<unsigned> cpus;
+            if (getline(list, text) && parseCpuList(text, cpus)) {
+                for (unsigned node_cpu : cpus) {
+                    nodes[node_cpu] = atoi(name.c_str() + 4);
+                }
+            }
+        }
+        return nodes;
+    }();
+    return cpu < nodes.size() ? nodes[cpu] : 0;
+#endif
+}
+
+// one step of a busy wait, it tells the core that this is a spin loop
+inline void cpuRelax() {
+#if defined(_M_X64) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    this_thread::yield();
+#endif
+}
+
+
+
+//////////////////////////////////////////// REPORT SINK ///////////////////////////////////////////////////////
+// execution reports (or market data updates) of one instrument in order flow order. One thread appends and one
+// thread takes them out, both without a lock, so the reports can be written while the matching is still running.
+// Reports are kept in a list of fixed size blocks and a block is freed as soon as it is taken out
+template <typename Record>
+class RecordSink {
+public:
+    static const size_t BLOCK_SIZE = 1024; // there is a sink per instrument, keep the first block small
+
+    RecordSink() {
+        this->tail = this->head = new Block();
+    }
+
+    ~RecordSink() {
+        while (this->head != nullptr) {
+            Block* next = this->head->next;
+            delete this->head;
+            this->head = next;
+        }
+        delete this->spare.load();
+    }
+
+    RecordSink(const RecordSink&) = delete;
+    RecordSink& operator=(const RecordSink&) = delete;
+
+    //----------------------------------- PRODUCER SIDE----------------------------------
+    void append(const Record& report) {
+        if (this->tail_count == BLOCK_SIZE) {
+            Block* block = this->spare.exchange(nullptr, memory_order_acquire); // one the consumer is done with
+            if (block == nullptr) {
+                block = new Block();
+            }
+            block->next = nullptr;
+            this->tail->next = block;
+            this->tail = block;
+            this->tail_count = 0;
+        }
+        this->tail->reports[this->tail_count++] = report;
+        this->published.store(this->published.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    //----------------------------------- CONSUMER SIDE----------------------------------
+    // the oldest report not taken out yet, nullptr if there is none for now
+    const Record* peek() {
+        if (this->consumed == this->published.load(memory_order_acquire)) {
+            return nullptr;
+        }
+        if (this->head_count == BLOCK_SIZE) { // move to the next block, the producer already linked it
+            Block* next = this->head->next;
+            delete this->spare.exchange(this->head, memory_order_release); // give it back to the producer
+            this->head = next;
+            this->head_count = 0;
+        }
+        return &this->head->reports[this->head_count];
+    }
+
+    // take out the report returned by peek
+    void pop() {
+        this->head_count++;
+        this->consumed++;
+    }
+
+private:
+    struct Block {
+        Record reports[BLOCK_SIZE];
+        Block* next = nullptr;
+    };
+
+    // producer and consumer fields are on separate cache lines
+    alignas(64) Block* tail;
+    size_t tail_count = 0;
+    atomic<size_t> published{ 0 };
+
+    alignas(64) Block* head;
+    size_t head_count = 0;
+    size_t consumed = 0;
+
+    atomic<Block*> spare{ nullptr }; // emptied block waiting to be reused by the producer
+};
+
+using ReportSink = RecordSink<Order>;
+using MarketDataSink = RecordSink<MarketUpdate>;
+
+
+
+//////////////////////////////////////////// ORDER FEED //////////////////////////////////////////////////////////
+// validated orders of one part of the input, already split by instrument
+struct OrderChunk {
+    const char* begin = nullptr; // input of the chunk, whole lines or whole binary records
+    const char* end = nullptr;
+    uint32_t first_row = 0; // row number of the first line in the chunk
+    uint32_t end_row = 0; // row number of the first line after the chunk
+    vector<vector<Order>> orders; // accepted orders of each instrument, indexed by instrument id
+    vector<Order> rejected_orders;
+    vector<uint32_t> tasks; // instruments with orders in the chunk, and the rejected task if there are rejects
+    atomic<uint32_t> pending{ 0 }; // tasks not done with the chunk yet
+    bool filled = false; // the reader is done with the chunk
+
+    // the tasks that have to look at the chunk, once its orders are in
+    void listTasks() {
+        for (uint32_t i = 0; i < this->orders.size(); i++) {
+            if (!this->orders[i].empty()) {
+                this->tasks.push_back(i);
+            }
+        }
+        if (!this->rejected_orders.empty()) {
+            this->tasks.push_back((uint32_t)this->orders.size());
+        }
+        this->pending = (uint32_t)this->tasks.size();
+    }
+};
+
+// hands the chunks from the readers to the matching tasks in input order. The readers fill the chunks in any
+// order, a chunk becomes ready only when all the chunks before it are ready, and then the tasks with orders
+// in it are scheduled. So a task never sees chunk i+1 before chunk i and the time priority of the orders is
+// kept while matching starts before the whole input is read. A chunk is freed when every task is done with it
+class OrderFeed {
+public:
+    // schedule is called for every task that has orders in a chunk that becomes ready
+    void setScheduler(function<void(uint32_t)> schedule) {
+        this->schedule = move(schedule);
+    }
+
+    // adds an empty chunk at the end of the feed
+    OrderChunk& addChunk() {
+        lock_guard<mutex> lock(this->mtx);
+        this->chunks.emplace_back(new OrderChunk());
+        this->chunks.back()->orders.resize(instruments.size());
+        return *this->chunks.back();
+    }
+
+    // the chunk is filled, its tasks and pending count are set
+    void publish(OrderChunk& chunk) {
+        lock_guard<mutex> lock(this->mtx);
+        chunk.filled = true;
+        while (this->ready_count < this->base + this->chunks.size() && this->chunks[this->ready_count - this->base]->filled) {
+            OrderChunk& ready = *this->chunks[this->ready_count - this->base];
+            this->ready_count++;
+            for (uint32_t task : ready.tasks) {
+                this->schedule(task);
+            }
+        }
+        this->advanceCompleted();
+    }
+
+    // no more chunks will be added
+    void finish() {
+        lock_guard<mutex> lock(this->mtx);
+        this->finished = true;
+        this->advanceCompleted();
+    }
+
+    // next ready chunk from index on that the task has orders in, nullptr if there is none yet. index is moved
+    // to it. The chunk stays alive until the task calls done on it; a chunk the task is not in can be freed by
+    // the other tasks at any time, so it is skipped under the lock and never handed out
+    OrderChunk* get(size_t& index, uint32_t task) {
+        lock_guard<mutex> lock(this->mtx);
+        if (index < this->base) {
+            index = this->base;
+        }
+        for (; index < this->ready_count; index++) {
+            OrderChunk* chunk = this->chunks[index - this->base].get();
+            if (find(chunk->tasks.begin(), chunk->tasks.end(), task) != chunk->tasks.end()) {
+                return chunk;
+            }
+        }
+        return nullptr;
+    }
+
+    // chunk at index if it is ready, nullptr otherwise. Only for a single reader of a feed that nobody calls done
+    // on, so no chunk is ever freed
+    OrderChunk* get(size_t& index) {
+        lock_guard<mutex> lock(this->mtx);
+        return index < this->ready_count ? this->chunks[index].get() : nullptr;
+    }
+
+    // a task is done with its orders in the chunk, the chunk must not be used after this
+    void done(OrderChunk& chunk) {
+        if (chunk.pending.fetch_sub(1) == 1) {
+            lock_guard<mutex> lock(this->mtx);
+            this->advanceCompleted();
+        }
+    }
+
+    // every report with an order flow below this is already in the sinks, UINT64_MAX when everything is done
+    uint64_t completedFlow() const {
+        return this->completed_flow.load(memory_order_acquire);
+    }
+
+    // start over for the next file, the feed must be done
+    void reset() {
+        lock_guard<mutex> lock(this->mtx);
+        this->chunks.clear();
+        this->base = 0;
+        this->ready_count = 0;
+        this->finished = false;
+        this->completed_flow.store(0, memory_order_release);
+    }
+
+private:
+    mutex mtx;
+    deque<unique_ptr<OrderChunk>> chunks;
+    size_t base = 0; // index of the first chunk still in chunks
+    size_t ready_count = 0; // chunks below this index are ready
+    bool finished = false;
+    atomic<uint64_t> completed_flow{ 0 };
+    function<void(uint32_t)> schedule;
+
+    // free the completed chunks at the front, the lock is held
+    void advanceCompleted() {
+        while (this->base < this->ready_count && this->chunks.front()->pending == 0) {
+            this->completed_flow.store(makeOrderFlow(this->chunks.front()->end_row), memory_order_release);
+            this->chunks.pop_front();
+            this->base++;
+        }
+        if (this->finished && this->chunks.empty()) {
+            this->completed_flow.store(UINT64_MAX, memory_order_release);
+        }
+    }
+};
+
+
+
+// fills the chunks on num_threads threads and publishes them. They are taken in input order so the first ones
+// are ready first. The threads take the ingest cpus from first_cpu on
+void fillChunks(OrderFeed& feed, const vector<OrderChunk*>& chunks, const function<void(OrderChunk&)>& fill, unsigned num_threads, unsigned first_cpu = 0) {
+    vector<thread> readers;
+    atomic<size_t> next_chunk(0);
+    for (unsigned t = 0; t < num_threads; t++) {
+        readers.emplace_back([&, t] {
+            pinThread(placement.ingest, first_cpu + t);
+            for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+                fill(*chunks[i]);
+                feed.publish(*chunks[i]);
+            }
+        });
+    }
+    for (thread& reader : readers) {
+        reader.join();
+    }
+}
+
+
+
+//////////////////////////////////////////// WORKER POOL /////////////////////////////////////////////////////////
+// fixed set of threads running tasks given by id. A task never runs on two workers at the same time, and a task
+// scheduled while it runs is run once more afterwards, so no work is lost. Every worker has its own queue and an
+// idle worker steals from the others of its NUMA node (all of them unless the workers are pinned), so a task
+// stays on the node of its home worker
+class WorkerPool {
+public:
+    // Constructor, tasks are 0..num_tasks-1
+    WorkerPool(size_t num_tasks, unsigned num_threads, function<void(uint32_t)> run)
+        : states(num_tasks), queues(new Queue[num_threads]), num_queues(num_threads), run(move(run)) {
+        vector<int> node_ids; // the nodes of the workers, numbered from 0 in the pool
+        for (unsigned i = 0; i < num_threads; i++) {
+            int node = placement.match.empty() ? 0 : cpuNode(placement.match[i % placement.match.size()]);
+            auto known = find(node_ids.begin(), node_ids.end(), node);
+            this->queues[i].node = (unsigned)(known - node_ids.begin());
+            if (known == node_ids.end()) {
+                node_ids.push_back(node);
+            }
+        }
+        this->num_nodes = (unsigned)node_ids.size();
+        this->queued.reset(new atomic<size_t>[this->num_nodes]);
+        for (unsigned node = 0; node < this->num_nodes; node++) {
+            this->queued[node] = 0;
+        }
+        for (unsigned i = 0; i < num_threads; i++) {
+            this->workers.emplace_back(&WorkerPool::work, this, i);
+        }
+    }
+
+    ~WorkerPool() {
+        this->stop();
+    }
+
+    void schedule(uint32_t task) {
+        uint8_t state = this->states[task].load();
+        while (state != QUEUED && state != RERUN) {
+            uint8_t next = state == IDLE ? QUEUED : RERUN;
+            if (this->states[task].compare_exchange_weak(state, next)) {
+                if (next == QUEUED) {
+                    this->push(task % this->num_queues, task);
+                }
+                return;
+            }
+        }
+    }
+
+    // wait until none of the tasks first..first+count-1 is queued or running. Nothing may schedule them meanwhile
+    void waitIdle(uint32_t first, uint32_t count) {
+        for (uint32_t task = first; task < first + count; task++) {
+            while (this->states[task].load() != IDLE) {
+                this_thread::yield();
+            }
+        }
+    }
+
+    // wait for the workers to end, the queued tasks are run first
+    void stop() {
+        {
+            lock_guard<mutex> lock(this->idle_mtx);
+            this->stopping = true;
+        }
+        this->idle_cv.notify_all();
+        for (thread& worker : this->workers) {
+            worker.join();
+        }
+        this->workers.clear();
+    }
+
+private:
+    enum : uint8_t { IDLE, QUEUED, RUNNING, RERUN };
+
+    struct alignas(64) Queue {
+        mutex mtx;
+        deque<uint32_t> tasks;
+        unsigned node = 0; // of the worker that owns the queue
+    };
+
+    vector<atomic<uint8_t>> states;
+    unique_ptr<Queue[]> queues;
+    unsigned num_queues;
+    function<void(uint32_t)> run;
+    vector<thread> workers;
+    unsigned num_nodes = 1;
+    unique_ptr<atomic<size_t>[]> queued; // tasks in the queues of each node
+    mutex idle_mtx;
+    condition_variable idle_cv;
+    atomic<bool> stopping{ false };
+
+    void push(size_t queue, uint32_t task) {
+        {
+            lock_guard<mutex> lock(this->queues[queue].mtx);
+            this->queues[queue].tasks.push_back(task);
+        }
+        this->queued[this->queues[queue].node]++;
+        if (placement.busy_poll) { // nobody sleeps
+            return;
+        }
+        {
+            lock_guard<mutex> lock(this->idle_mtx); // so a worker going to sleep can't miss it
+        }
+        if (this->num_nodes == 1) {
+            this->idle_cv.notify_one();
+        }
+        else { // only a worker of the node can take it
+            this->idle_cv.notify_all();
+        }
+    }
+
+    // oldest task of the own queue, or the newest one of another queue of the node
+    bool take(size_t self, uint32_t& task) {
+        for (size_t i = 0; i < this->num_queues; i++) {
+            Queue& queue = this->queues[(self + i) % this->num_queues];
+            if (queue.node != this->queues[self].node) {
+                continue;
+            }
+            lock_guard<mutex> lock(queue.mtx);
+            if (!queue.tasks.empty()) {
+                if (i == 0) {
+                    task = queue.tasks.front();
+                    queue.tasks.pop_front();
+                }
+                else {
+                    task = queue.tasks.back();
+                    queue.tasks.pop_back();
+                }
+                this->queued[queue.node]--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t self) {
+        pinThread(placement.match, self);
+        atomic<size_t>& queued = this->queued[this->queues[self].node];
+        while (true) {
+            uint32_t task;
+            if (!this->take(self, task)) {
+                if (placement.busy_poll) {
+                    if (this->stopping && queued == 0) {
+                        return;
+                    }
+                    cpuRelax();
+                    continue;
+                }
+                unique_lock<mutex> lock(this->idle_mtx);
+                this->idle_cv.wait(lock, [&] { return this->stopping || queued > 0; });
+                if (this->stopping && queued == 0) {
+                    return;
+                }
+                continue;
+            }
+
+            this->states[task] = RUNNING;
+            this->run(task);
+            uint8_t state = RUNNING;
+            if (!this->states[task].compare_exchange_strong(state, IDLE)) { // scheduled again while running
+                this->states[task] = QUEUED;
+                this->push(self, task);
+            }
+        }
+    }
+};
+
+
+
+//////////////////////////////////////////// MAPPED FILE /////////////////////////////////////////////////////////
+// read-only memory map of a whole file, the reader scans the mapped bytes in place
+class MappedFile {
+public:
+    // Constructor
+    MappedFile(const string& filename) {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file, &file_size);
+        this->length = (size_t)file_size.QuadPart;
+        this->opened = true;
+        if (this->length != 0) {
+            HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping != NULL) {
+                this->bytes = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+            this->opened = this->bytes != nullptr;
+        }
+        CloseHandle(file);
+#else
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            this->length = (size_t)info.st_size;
+            this->opened = true;
+            if (this->length != 0) {
+                void* address = mmap(nullptr, this->length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (address == MAP_FAILED) {
+                    this->opened = false;
+                }
+                else {
+                    this->bytes = (const char*)address;
+                    madvise(address, this->length, MADV_SEQUENTIAL);
+                }
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+        if (this->bytes == nullptr) {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile(this->bytes);
+#else
+        munmap((void*)this->bytes, this->length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const {
+        return this->opened;
+    }
+
+    const char* data() const {
+        return this->bytes;
+    }
+
+    size_t size() const {
+        return this->length;
+    }
+
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+    bool opened = false;
+};
+
+
+
+//////////////////////////////////////////// BINARY FORMAT ///////////////////////////////////////////////////////
+// fixed-width records for orders and execution reports, so a day can be replayed without parsing text again.
+// A file is: header, instrument names (16-bit length and bytes), padding to 8, the records, the text (client
+// order ids and the raw fields of rejected rows, each a 16-bit length and bytes), footer. The counts are in
+// the footer so a file can be written to a pipe. All numbers are little endian
+const char BINARY_ORDERS_MAGIC[8] = { 'F', 'L', 'O', 'W', 'O', 'R', 'D', 'S' };
+const char BINARY_REPORTS_MAGIC[8] = { 'F', 'L', 'O', 'W', 'E', 'X', 'E', 'C' };
+const char BINARY_MARKET_MAGIC[8] = { 'F', 'L', 'O', 'W', 'B', 'O', 'O', 'K' }; // records are MarketUpdate
+const uint32_t BINARY_VERSION = 2;
+
+struct BinaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size; // a reader checks it against its own layout
+    uint32_t instrument_count;
+    uint32_t records_offset; // from the start of the file
+};
+
+struct BinaryFooter {
+    uint64_t record_count;
+    uint64_t text_offset; // from the start of the file
+    uint64_t text_size;
+    char magic[8]; // same as the header
+};
+
+// one input row. A row that failed validation keeps its reason and the text it had
+struct BinaryOrder {
+    int64_t price; // fixed-point, see PRICE_SCALE
+    uint32_t client; // text offset of the client order id
+    uint32_t raw; // text offset of the raw instrument, side, quantity, price and type of a rejected row
+    int32_t quantity;
+    uint32_t row; // row number in the input, the order id
+    uint16_t instrument; // index in the instrument names of the file
+    uint16_t reason; // 200 for a valid row
+    uint8_t side; // Side
+    uint8_t type; // OrderType, 0 is a new order
+    uint8_t unused[2];
+};
+
+// one execution report
+struct BinaryReport {
+    int64_t price;
+    int64_t timestamp; // microseconds since epoch
+    uint32_t order_id;
+    uint32_t client; // text offset of the client order id
+    uint32_t raw; // text offset of the raw fields of a rejected row, NO_RAW when the fields are the typed ones
+    int32_t quantity;
+    uint16_t instrument; // index in the instrument names of the file
+    uint16_t reason;
+    uint8_t side;
+    uint8_t exec_status; // ExecStatus
+    uint8_t unused[2];
+};
+
+static_assert(sizeof(BinaryHeader) == 24 && sizeof(BinaryFooter) == 32, "binary layout changed");
+static_assert(sizeof(BinaryOrder) == 32 && sizeof(BinaryReport) == 40, "binary layout changed");
+
+// checked view of a mapped binary file
+class BinaryFile {
+public:
+    static bool isBinary(const MappedFile& file) {
+        return file.size() >= 4 && memcmp(file.data(), "FLOW", 4) == 0;
+    }
+
+    // Constructor, the file must stay mapped
+    BinaryFile(const MappedFile& file, const char* magic, uint32_t record_size) {
+        if (file.size() < sizeof(BinaryHeader) + sizeof(BinaryFooter)) {
+            return;
+        }
+        memcpy(&this->header, file.data(), sizeof(this->header));
+        memcpy(&this->footer, file.data() + file.size() - sizeof(this->footer), sizeof(this->footer));
+        // the header, records, text and footer follow each other inside the file. Each bound is checked by
+        // subtracting from one already checked, a corrupt count or offset can't wrap around
+        uint64_t body_end = file.size() - sizeof(BinaryFooter);
+        if (memcmp(this->header.magic, magic, 8) != 0 || memcmp(this->footer.magic, magic, 8) != 0
+            || this->header.version != BINARY_VERSION || this->header.record_size != record_size
+            || this->header.records_offset < sizeof(BinaryHeader)
+            || this->footer.text_offset < this->header.records_offset || this->footer.text_offset > body_end
+            || this->footer.text_size > body_end - this->footer.text_offset
+            || this->footer.record_count > (this->footer.text_offset - this->header.records_offset) / record_size) {
+            return;
+        }
+
+        this->bytes = file.data();
+        size_t pos = sizeof(BinaryHeader);
+        for (uint32_t i = 0; i < this->header.instrument_count && pos + 2 <= this->header.records_offset; i++) {
+            uint16_t length;
+            memcpy(&length, this->bytes + pos, 2);
+            this->names.emplace_back(this->bytes + pos + 2, min<size_t>(length, this->header.records_offset - pos - 2));
+            pos += 2 + length;
+        }
+        this->valid = this->names.size() == this->header.instrument_count;
+    }
+
+    bool isValid() const {
+        return this->valid;
+    }
+
+    size_t count() const {
+        return (size_t)this->footer.record_count;
+    }
+
+    const char* record(size_t index) const {
+        return this->bytes + this->header.records_offset + index * this->header.record_size;
+    }
+
+    const vector<string_view>& instrumentNames() const {
+        return this->names;
+    }
+
+    // text entry at offset, offset moves to the next entry
+    string_view text(uint32_t& offset) const {
+        if ((uint64_t)offset + 2 > this->footer.text_size) {
+            return string_view();
+        }
+        const char* entry = this->bytes + this->footer.text_offset + offset;
+        uint16_t length;
+        memcpy(&length, entry, 2);
+        length = (uint16_t)min<uint64_t>(length, this->footer.text_size - offset - 2);
+        offset += 2 + length;
+        return string_view(entry + 2, length);
+    }
+
+private:
+    const char* bytes = nullptr;
+    BinaryHeader header = {};
+    BinaryFooter footer = {};
+    vector<string_view> names;
+    bool valid = false;
+};
+
+// binary output is chosen by the file name
+bool isBinaryName(const string& filename) {
+    return filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".bin") == 0;
+}
+
+// files are always read and written byte for byte: in text mode the Windows CRT turns a 0x0A byte of a binary
+// record into CRLF and stops reading at 0x1A, and the offsets kept in a snapshot would not match the file
+#ifdef _WIN32
+const int OPEN_BINARY = O_BINARY;
+
+void setBinaryMode(int fd) {
+    _setmode(fd, _O_BINARY);
+}
+#else
+const int OPEN_BINARY = 0;
+
+void setBinaryMode(int) {
+}
+#endif
+
+
+
+//////////////////////////////////////////// REPORT WRITER ////////////////////////////////////////////////////
+// formats the execution reports straight into a large buffer and writes the buffer in big chunks
+class ReportWriter {
+public:
+    static const size_t BUFFER_SIZE = 1 << 20;
+
+    // Constructor, "-" is stdout. A binary writer writes the reports as BinaryReport records. keep is the number
+    // of bytes of an existing file that stay, the reports go after them (a restart from a snapshot). The file
+    // is not opened if it is shorter than that
+    ReportWriter(const string& filename, bool binary = false, uint64_t keep = 0) : buffer(BUFFER_SIZE), written(keep), binary(binary) {
+        this->fd = filename == "-" ? 1 : open(filename.c_str(), O_WRONLY | O_CREAT | OPEN_BINARY | (keep == 0 ? O_TRUNC : 0), 0644);
+        if (this->fd == 1) {
+            setBinaryMode(1);
+        }
+        if (keep != 0 && this->fd > 1 && !this->keepBytes(keep)) {
+            close(this->fd);
+            this->fd = -1;
+        }
+    }
+
+    ~ReportWriter() {
+        if (this->binary_magic != nullptr) {
+            this->finishBinary();
+        }
+        this->flush();
+        if (this->fd > 1) {
+            close(this->fd);
+        }
+    }
+
+    ReportWriter(const ReportWriter&) = delete;
+    ReportWriter& operator=(const ReportWriter&) = delete;
+
+    bool isOpen() const {
+        return this->fd >= 0;
+    }
+
+    //----------------------------------- WRITE THE HEADER ROW-----------------------------------------------------
+    void writeHeader() {
+        if (this->binary) {
+            this->writeBinaryHeader(BINARY_REPORTS_MAGIC, sizeof(BinaryReport));
+            return;
+        }
+        static const char header[] = "Order ID,Client Order ID,Instrument,Side,Exec Status,Quantity,Price,Transaction Time,Reason\n";
+        char* out = this->reserve(sizeof(header));
+        memcpy(out, header, sizeof(header) - 1);
+        this->used += sizeof(header) - 1;
+    }
+
+    //----------------------------------- WRITE TEXT AS IT IS-----------------------------------------------------
+    void writeText(string_view text) {
+        char* out = this->reserve(text.size());
+        memcpy(out, text.data(), text.size());
+        this->used += text.size();
+    }
+
+    //----------------------------------- WRITE ONE REPORT-----------------------------------------------------
+    void writeReport(const Order& report) {
+        STAT(LatencyHistogram& write_latency = stats.thread().write);
+        STAT(int64_t write_start = write_latency.start());
+        if (this->binary) {
+            this->writeBinaryReport(report);
+        }
+        else if (report.exec_status == ExecStatus::Reject && report.raw_row != NO_RAW) {
+            const RejectedRow& row = rejected_rows[report.raw_row];
+            string_view raw[4] = { row.instrument, row.side, row.quantity, row.price };
+            this->writeRow(report, row.client, string_view(), raw);
+        }
+        else {
+            this->writeRow(report, clients.name(report.customer_id), instruments.name(report.instrument), nullptr);
+        }
+        if (this->release_names) {
+            this->releaseNames(report);
+        }
+        STAT(write_latency.stop(write_start));
+    }
+
+    // the client order id and rejected row of a report are released once it is written, for a run that keeps
+    // going (stream mode) or shares the tables with other files (--multi)
+    void setReleaseNames() {
+        this->release_names = true;
+    }
+
+    //----------------------------------- MARKET DATA-----------------------------------------------------
+    void writeMarketHeader() {
+        if (this->binary) {
+            this->writeBinaryHeader(BINARY_MARKET_MAGIC, sizeof(MarketUpdate));
+            return;
+        }
+        this->writeText("Sequence,Instrument,Update,Side,Price,Quantity,Orders\n");
+    }
+
+    // the sequence is the row number of the order that made the change. The Top of an empty side has no price
+    void writeUpdate(const MarketUpdate& update) {
+        if (this->binary) {
+            this->writeRecord(&update, sizeof(update));
+            return;
+        }
+        const string& instrument = instruments.name(update.instrument);
+        char* out = this->reserve(128 + instrument.size());
+        char* start = out;
+        out = to_chars(out, out + 10, (uint32_t)(update.order_flow >> SUB_SEQUENCE_BITS)).ptr;
+        *out++ = ',';
+        out = put(out, instrument);
+        *out++ = ',';
+        out = put(out, update.kind == MarketUpdateKind::Depth ? "Depth" : "Top");
+        *out++ = ',';
+        *out++ = (char)('0' + (int)update.side);
+        *out++ = ',';
+        if (update.orders != 0 || update.kind == MarketUpdateKind::Depth) {
+            out = writePrice(out, update.price);
+        }
+        *out++ = ',';
+        out = to_chars(out, out + 20, update.quantity).ptr;
+        *out++ = ',';
+        out = to_chars(out, out + 10, update.orders).ptr;
+        *out++ = '\n';
+        this->used += out - start;
+    }
+
+    //----------------------------------- WRITE ONE REPORT AS A CSV ROW-----------------------------------------------------
+    // raw is the instrument, side, quantity and price text of a rejected row, nullptr for the others
+    void writeRow(const Order& report, string_view client, string_view instrument, const string_view* raw) {
+        // numbers and fixed text take less than 128 chars
+        size_t length = 128 + client.size();
+        length += raw != nullptr ? raw[0].size() + raw[1].size() + raw[2].size() + raw[3].size() : instrument.size();
+        char* out = this->reserve(length);
+        char* start = out;
+
+        out = put(out, "ord");
+        out = to_chars(out, out + 10, report.order_id).ptr;
+        *out++ = ',';
+        out = put(out, client);
+        *out++ = ',';
+        if (raw != nullptr) { // echo back what the client sent
+            out = put(out, raw[0]);
+            *out++ = ',';
+            out = put(out, raw[1]);
+            *out++ = ',';
+            out = put(out, execStatusName(report.exec_status));
+            *out++ = ',';
+            out = put(out, raw[2]);
+            *out++ = ',';
+            out = put(out, raw[3]);
+            *out++ = ',';
+            out = this->timestamps.write(out, report.timestamp);
+            *out++ = ',';
+            out = put(out, reasonText(report.reason));
+        }
+        else {
+            out = put(out, instrument);
+            *out++ = ',';
+            *out++ = (char)('0' + (int)report.side);
+            *out++ = ',';
+            out = put(out, execStatusName(report.exec_status));
+            *out++ = ',';
+            out = to_chars(out, out + 11, report.quantity).ptr;
+            *out++ = ',';
+            out = writePrice(out, report.price);
+            *out++ = ',';
+            out = this->timestamps.write(out, report.timestamp);
+            *out++ = ',';
+            if (report.reason != 200) { // rejected by the matching
+                out = put(out, reasonText(report.reason));
+            }
+        }
+        *out++ = ',';
+        *out++ = '\n';
+        this->used += out - start;
+    }
+
+    //----------------------------------- BINARY FILES-----------------------------------------------------
+    // header and the instrument names of the registry, the records follow
+    void writeBinaryHeader(const char* magic, uint32_t record_size) {
+        BinaryHeader header = {};
+        memcpy(header.magic, magic, 8);
+        header.version = BINARY_VERSION;
+        header.record_size = record_size;
+        header.instrument_count = (uint32_t)instruments.size();
+        size_t names_size = 0;
+        for (uint32_t i = 0; i < instruments.size(); i++) {
+            names_size += 2 + min<size_t>(instruments.name(i).size(), UINT16_MAX);
+        }
+        header.records_offset = (uint32_t)((sizeof(header) + names_size + 7) / 8 * 8);
+
+        this->writeText(string_view((const char*)&header, sizeof(header)));
+        for (uint32_t i = 0; i < instruments.size(); i++) {
+            this->writeEntry(instruments.name(i));
+        }
+        this->writeText(string_view("\0\0\0\0\0\0\0", header.records_offset - sizeof(header) - names_size));
+        this->binary_magic = magic;
+        this->records_end = header.records_offset;
+    }
+
+    void writeRecord(const void* record, size_t size) {
+        this->writeText(string_view((const char*)record, size));
+        this->record_count++;
+        this->records_end += size;
+    }
+
+    // keeps the text for the end of the file, returns its offset in the text
+    uint32_t addText(string_view text) {
+        uint32_t offset = (uint32_t)this->text.size();
+        uint16_t length = (uint16_t)min<size_t>(text.size(), UINT16_MAX);
+        this->text.append((const char*)&length, 2);
+        this->text.append(text.data(), length);
+        return offset;
+    }
+
+    // the text and the footer, nothing can be added after this
+    void finishBinary() {
+        BinaryFooter footer = {};
+        footer.record_count = this->record_count;
+        footer.text_offset = this->records_end;
+        footer.text_size = this->text.size();
+        memcpy(footer.magic, this->binary_magic, 8);
+        this->writeText(this->text);
+        this->writeText(string_view((const char*)&footer, sizeof(footer)));
+        string().swap(this->text);
+        this->binary_magic = nullptr;
+    }
+
+    //----------------------------------- MERGE THE SINKS INTO THE FILE-----------------------------------------------------
+    // runs while the matching tasks are still filling the sinks. Every report below the completed order flow of
+    // the feed is already appended, so those are merged by order flow and written, then the feed is asked
+    // again. Ends when the feed is done and every sink is empty, returns the number of reports. The market
+    // data is merged the same way
+    template <typename Record>
+    size_t writeMerged(const vector<unique_ptr<RecordSink<Record>>>& sinks, const OrderFeed& feed) {
+        size_t written = 0;
+        priority_queue<pair<uint64_t, size_t>, vector<pair<uint64_t, size_t>>, greater<pair<uint64_t, size_t>>> heads; // min-heap of { order flow, sink }
+        vector<bool> in_heap(sinks.size(), false);
+
+        while (true) {
+            uint64_t safe = feed.completedFlow(); // read before peek
+            for (size_t i = 0; i < sinks.size(); i++) {
+                const Record* report = in_heap[i] ? nullptr : sinks[i]->peek();
+                if (report != nullptr) {
+                    heads.push({ report->order_flow, i });
+                    in_heap[i] = true;
+                }
+            }
+
+            bool progress = false;
+            while (!heads.empty() && heads.top().first < safe) {
+                size_t i = heads.top().second;
+                heads.pop();
+                this->writeAny(*sinks[i]->peek());
+                sinks[i]->pop();
+                written++;
+                progress = true;
+
+                const Record* next = sinks[i]->peek();
+                in_heap[i] = next != nullptr;
+                if (next != nullptr) {
+                    heads.push({ next->order_flow, i });
+                }
+            }
+
+            if (safe == UINT64_MAX && heads.empty()) {
+                break;
+            }
+            STAT(stats.poll());
+            if (!progress && placement.busy_poll) { // the matching is behind, ask again right away
+                cpuRelax();
+            }
+            else if (!progress) { // the matching is behind, give it the cpu
+                this_thread::sleep_for(chrono::microseconds(100));
+            }
+        }
+        this->flush();
+        return written;
+    }
+
+    //----------------------------------- WRITE THE BUFFER OUT-----------------------------------------------------
+    void flush() {
+        size_t done = 0;
+        while (done < this->used && this->fd >= 0) {
+            auto length = write(this->fd, this->buffer.data() + done, (unsigned)(this->used - done));
+            if (length < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                cerr << "Error writing output file." << endl;
+                break;
+            }
+            done += length;
+        }
+        this->written += done;
+        this->ok = this->ok && done == this->used;
+        this->used = 0;
+    }
+
+    // flush and wait until the bytes are on disk, false if anything could not be written
+    bool sync() {
+        this->flush();
+#ifdef _WIN32
+        return _commit(this->fd) == 0 && this->ok;
+#else
+        return fsync(this->fd) == 0 && this->ok;
+#endif
+    }
+
+    // bytes of the file, the buffered ones included
+    uint64_t size() const {
+        return this->written + this->used;
+    }
+
+private:
+    int fd;
+    vector<char> buffer;
+    size_t used = 0;
+    uint64_t written = 0; // bytes in the file, kept ones included
+    bool ok = true; // every write went through
+    TimestampFormatter timestamps;
+
+    bool release_names = false;
+    bool binary; // reports as BinaryReport records
+    const char* binary_magic = nullptr; // set while a binary file is open
+    uint64_t record_count = 0;
+    uint64_t records_end = 0; // file offset after the last record
+    string text; // text of the binary file, written at the end
+    unordered_map<uint32_t, uint32_t> client_text; // text offset of the client ids of the open orders
+
+    // cut the file after length bytes and write from there, false if the file is shorter
+    bool keepBytes(uint64_t length) {
+#ifdef _WIN32
+        return _filelengthi64(this->fd) >= (int64_t)length && _chsize_s(this->fd, (int64_t)length) == 0
+            && _lseeki64(this->fd, (int64_t)length, SEEK_SET) >= 0;
+#else
+        struct stat info;
+        return fstat(this->fd, &info) == 0 && (uint64_t)info.st_size >= length && ftruncate(this->fd, (off_t)length) == 0
+            && lseek(this->fd, (off_t)length, SEEK_SET) >= 0;
+#endif
+    }
+
+    void writeAny(const Order& report) {
+        this->writeReport(report);
+    }
+
+    // a filled or rejected order gets no more reports, its text is not needed anymore. A cancel or amend request
+    // holds the name too, the request is done with its Cancelled or Replaced report. A row rejected by the
+    // validation has its text in its rejected row. An order still resting at the end keeps its name
+    void releaseNames(const Order& report) {
+        if (report.exec_status == ExecStatus::Fill || report.exec_status == ExecStatus::Cancelled
+            || (report.exec_status == ExecStatus::Reject && report.raw_row == NO_RAW)) {
+            clients.release(report.customer_id);
+        }
+        if (report.exec_status == ExecStatus::Cancelled || report.exec_status == ExecStatus::Replaced) {
+            clients.release(report.customer_id);
+        }
+        if (report.exec_status == ExecStatus::Reject && report.raw_row != NO_RAW) {
+            rejected_rows.release(report.raw_row);
+        }
+    }
+
+    void writeAny(const MarketUpdate& update) {
+        this->writeUpdate(update);
+    }
+
+    void writeEntry(string_view text) {
+        uint16_t length = (uint16_t)min<size_t>(text.size(), UINT16_MAX);
+        this->writeText(string_view((const char*)&length, 2));
+        this->writeText(text.substr(0, length));
+    }
+
+    // a client order id is kept once while its order is open
+    void writeBinaryReport(const Order& report) {
+        BinaryReport record = {};
+        record.price = report.price;
+        record.timestamp = report.timestamp;
+        record.order_id = report.order_id;
+        record.quantity = report.quantity;
+        record.instrument = report.instrument;
+        record.reason = report.reason;
+        record.side = (uint8_t)report.side;
+        record.exec_status = (uint8_t)report.exec_status;
+
+        record.raw = NO_RAW;
+        if (report.exec_status == ExecStatus::Reject && report.raw_row != NO_RAW) { // the only report of the row
+            const RejectedRow& row = rejected_rows[report.raw_row];
+            record.client = this->addText(row.client);
+            record.raw = this->addText(row.instrument);
+            this->addText(row.side);
+            this->addText(row.quantity);
+            this->addText(row.price);
+            this->writeRecord(&record, sizeof(record));
+            return;
+        }
+
+        auto client = this->client_text.find(report.customer_id);
+        if (client == this->client_text.end()) {
+            client = this->client_text.emplace(report.customer_id, this->addText(clients.name(report.customer_id))).first;
+        }
+        record.client = client->second;
+        if (report.exec_status == ExecStatus::Fill || report.exec_status == ExecStatus::Reject
+            || report.exec_status == ExecStatus::Cancelled) { // no more reports
+            this->client_text.erase(client);
+        }
+        this->writeRecord(&record, sizeof(record));
+    }
+
+    // room for length more chars at the end of the buffer
+    char* reserve(size_t length) {
+        if (this->used + length > this->buffer.size()) {
+            this->flush();
+            if (length > this->buffer.size()) {
+                this->buffer.resize(length);
+            }
+        }
+        return this->buffer.data() + this->used;
+    }
+
+    static char* put(char* out, string_view text) {
+        memcpy(out, text.data(), text.size());
+        return out + text.size();
+    }
+
+    //----------------------------------- REASON OF A REJECTED ORDER -----------------------------------------------------
+    static const char* reasonText(int error_code) {
+        switch (error_code) {
+        case 400: return "Missing field";
+        case 401: return "Invalid instrument";
+        case 402: return "Invalid side";
+        case 403: return "Invalid quantity";
+        case 404: return "Invalid price";
+        case 405: return "Unknown order";
+        case 406: return "Invalid order type";
+        default: return "";
+        }
+    }
+};
+
+
+
+//////////////////////////////////////////// SNAPSHOT ///////////////////////////////////////////////////////////
+// the resting orders of every book at a point of a stream, so a restarted engine loads the books and reads only
+// the input after that point. A snapshot is a binary file like the order files: the instruments, one record per
+// resting order (the orders of a book in order flow order) and the client order ids in the text. The first text
+// entry is the StreamPosition of the snapshot
+const char SNAPSHOT_MAGIC[8] = { 'F', 'L', 'O', 'W', 'S', 'N', 'A', 'P' };
+
+// how far a stream got
+struct StreamPosition {
+    uint64_t input_offset = 0; // bytes of input read, up to the end of a line, the header included
+    uint64_t output_offset = 0; // bytes of reports written for that input
+    uint32_t rows = 0; // rows after the header, the order id of the last one
+    uint32_t unused = 0;
+};
+
+struct SnapshotOrder {
+    uint64_t order_flow;
+    int64_t price; // fixed-point, see PRICE_SCALE
+    uint32_t order_id;
+    uint32_t client; // text offset of the client order id
+    int32_t quantity; // what is left of the order
+    uint16_t instrument; // index in the instrument names of the file
+    uint8_t side; // Side
+    uint8_t unused;
+};
+
+static_assert(sizeof(StreamPosition) == 24 && sizeof(SnapshotOrder) == 32, "snapshot layout changed");
+
+//----------------------------------- SAVE A SNAPSHOT-----------------------------------------------------
+// the snapshot is written to a new file that replaces the old one when it is on disk, so a crash while saving
+// leaves the previous snapshot
+bool saveSnapshot(const string& filename, const vector<unique_ptr<OrderBook>>& books, const StreamPosition& position) {
+    string temporary = filename + ".tmp";
+    {
+        ReportWriter file(temporary, true);
+        if (!file.isOpen()) {
+            cerr << "Error writing snapshot." << endl;
+            return false;
+        }
+        file.writeBinaryHeader(SNAPSHOT_MAGIC, sizeof(SnapshotOrder));
+        file.addText(string_view((const char*)&position, sizeof(position)));
+
+        vector<Order> resting; // orders of one book
+        for (uint32_t i = 0; i < books.size(); i++) {
+            resting.clear();
+            books[i]->forEachResting([&](const Order& order) { resting.push_back(order); });
+            sort(resting.begin(), resting.end(), [](const Order& a, const Order& b) {
+                return a.order_flow < b.order_flow;
+            });
+            for (const Order& order : resting) {
+                SnapshotOrder record = {};
+                record.order_flow = order.order_flow;
+                record.price = order.price;
+                record.order_id = order.order_id;
+                record.client = file.addText(clients.name(order.customer_id));
+                record.quantity = order.quantity;
+                record.instrument = (uint16_t)i;
+                record.side = (uint8_t)order.side;
+                file.writeRecord(&record, sizeof(record));
+            }
+        }
+        file.finishBinary();
+        if (!file.sync()) {
+            cerr << "Error writing snapshot." << endl;
+            return false;
+        }
+    }
+#ifdef _WIN32
+    bool renamed = MoveFileExA(temporary.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool renamed = rename(temporary.c_str(), filename.c_str()) == 0;
+#endif
+    if (!renamed) {
+        cerr << "Error writing snapshot." << endl;
+    }
+    return renamed;
+}
+
+//----------------------------------- LOAD A SNAPSHOT-----------------------------------------------------
+// fills the empty books and the position. No file is a fresh start from the beginning of the input
+bool loadSnapshot(const string& filename, vector<unique_ptr<OrderBook>>& books, StreamPosition& position) {
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0) {
+        return true;
+    }
+    MappedFile file(filename);
+    BinaryFile snapshot(file, SNAPSHOT_MAGIC, sizeof(SnapshotOrder));
+    uint32_t offset = 0;
+    string_view saved = snapshot.isValid() ? snapshot.text(offset) : string_view();
+    if (saved.size() != sizeof(position)) {
+        cerr << "Invalid snapshot file." << endl;
+        return false;
+    }
+    memcpy(&position, saved.data(), sizeof(position));
+
+    vector<uint32_t> instrument_ids;
+    for (string_view name : snapshot.instrumentNames()) {
+        uint32_t id;
+        instrument_ids.push_back(instruments.find(name, id) ? id : UINT32_MAX);
+    }
+    for (size_t i = 0; i < snapshot.count(); i++) {
+        SnapshotOrder record;
+        memcpy(&record, snapshot.record(i), sizeof(record));
+        uint32_t instrument = record.instrument < instrument_ids.size() ? instrument_ids[record.instrument] : UINT32_MAX;
+        if (instrument == UINT32_MAX) {
+            cerr << "The snapshot has orders of an instrument that is not tradable." << endl;
+            return false;
+        }
+        uint32_t client_offset = record.client;
+        Order order(record.order_id, clients.intern(snapshot.text(client_offset)));
+        order.order_flow = record.order_flow;
+        order.price = record.price;
+        order.quantity = record.quantity;
+        order.instrument = (uint16_t)instrument;
+        order.side = (Side)record.side;
+        books[instrument]->restore(order);
+    }
+    return true;
+}
+
+
+
+//////////////////////////////////////////// ROW VALIDATION //////////////////////////////////////////////////////
+// rows are validated a block at a time. The fields of the block are split into columns, each column is converted
+// in its own loop into a column of error codes, and the reason of every row comes out of branch-free selects over
+// those columns, which the compiler turns into vector code. A rejected row costs no more than an accepted one
+
+//-------------------------------- INSTRUMENT LOOKUP----------------------------------------------------
+// the tradable instruments in one flat table, probed with a hash of the length and the first and last bytes of
+// a name. Much cheaper than the symbol table for the lookup of every row, the set of names never changes
+class InstrumentMatcher {
+public:
+    // Constructor, the instruments must be known
+    InstrumentMatcher() {
+        size_t size = 16;
+        while (size < instruments.size() * 4) {
+            size *= 2;
+        }
+        this->slots.assign(size, { 0, UINT32_MAX });
+        this->mask = size - 1;
+        for (uint32_t id = 0; id < instruments.size(); id++) {
+            uint64_t key = keyOf(instruments.name(id));
+            size_t i = key & this->mask;
+            while (this->slots[i].id != UINT32_MAX) {
+                i = (i + 1) & this->mask;
+            }
+            this->slots[i] = { key, id };
+        }
+    }
+
+    // id of the instrument, UINT32_MAX if the name is not tradable
+    uint32_t find(string_view name) const {
+        uint64_t key = keyOf(name);
+        for (size_t i = key & this->mask; this->slots[i].id != UINT32_MAX; i = (i + 1) & this->mask) {
+            if (this->slots[i].key == key && instruments.name(this->slots[i].id) == name) {
+                return this->slots[i].id;
+            }
+        }
+        return UINT32_MAX;
+    }
+
+private:
+    struct Slot {
+        uint64_t key;
+        uint32_t id;
+    };
+    vector<Slot> slots;
+    size_t mask;
+
+    // the loads overlap for short names, so every byte of a name up to 16 bytes is in the key
+    static uint64_t keyOf(string_view name) {
+        const char* p = name.data();
+        size_t n = name.size();
+        uint64_t first = 0;
+        uint64_t last = 0;
+        if (n >= 8) {
+            memcpy(&first, p, 8);
+            memcpy(&last, p + n - 8, 8);
+        }
+        else if (n >= 4) {
+            uint32_t word;
+            memcpy(&word, p, 4);
+            first = word;
+            memcpy(&word, p + n - 4, 4);
+            last = word;
+        }
+        else if (n > 0) {
+            first = (uint8_t)p[0] | (uint32_t)(uint8_t)p[n / 2] << 8 | (uint32_t)(uint8_t)p[n - 1] << 16;
+        }
+        uint64_t key = (first * 0x9E3779B97F4A7C15ull) ^ ((last + n) * 0xC2B2AE3D27D4EB4Full);
+        return key ^ (key >> 29);
+    }
+};
+
+//-------------------------------- A BLOCK OF ROWS----------------------------------------------------
+// columns of up to ROWS rows. add splits a row into the field columns, validate fills the reasons and the typed
+// columns. The same checks and reasons as always: the order type first (406), then the columns from left to
+// right, an empty field is 400 and a bad one 401..404. A cancel only needs the first three columns
+class RowBlock {
+public:
+    static const size_t ROWS = 256;
+    static const int COLUMNS = 6; // the sixth is the optional order type, the rest of a line is ignored
+
+    size_t count = 0;
+    uint32_t rows[ROWS]; // row numbers
+    string_view fields[COLUMNS][ROWS];
+    uint16_t reasons[ROWS]; // 200 when the row is accepted
+
+    // typed columns, valid for an accepted row
+    uint32_t instrument_ids[ROWS];
+    Side sides[ROWS];
+    int32_t quantities[ROWS];
+    int64_t prices[ROWS];
+    OrderType types[ROWS];
+
+    bool full() const {
+        return this->count == ROWS;
+    }
+
+    // split a row at its commas, a missing field is empty
+    void add(string_view line, uint32_t row) {
+        size_t i = this->count++;
+        this->rows[i] = row;
+        size_t start = 0;
+        for (int column = 0; column < COLUMNS; column++) {
+            if (start > line.size()) {
+                this->fields[column][i] = string_view();
+                continue;
+            }
+            size_t comma = line.find(',', start);
+            if (comma == string_view::npos) {
+                comma = line.size();
+            }
+            this->fields[column][i] = line.substr(start, comma - start);
+            start = comma + 1;
+        }
+    }
+
+    void validate(const InstrumentMatcher& matcher) {
+        size_t n = this->count;
+
+        // one conversion loop per column, each gives an error code per row, 0 when the field is fine
+        for (size_t i = 0; i < n; i++) {
+            string_view field = this->fields[5][i];
+            char c = field.size() == 1 ? field[0] : 0;
+            this->types[i] = c == 'C' ? OrderType::Cancel : c == 'A' ? OrderType::Amend : OrderType::New;
+            this->errors[5][i] = field.empty() || c == 'N' || c == 'C' || c == 'A' ? 0 : 406;
+        }
+        for (size_t i = 0; i < n; i++) {
+            this->errors[0][i] = this->fields[0][i].empty() ? 400 : 0;
+        }
+        for (size_t i = 0; i < n; i++) {
+            this->instrument_ids[i] = matcher.find(this->fields[1][i]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            this->errors[1][i] = this->fields[1][i].empty() ? 400 : this->instrument_ids[i] == UINT32_MAX ? 401 : 0;
+        }
+        for (size_t i = 0; i < n; i++) {
+            string_view field = this->fields[2][i];
+            char c = field.size() == 1 ? field[0] : 0;
+            this->sides[i] = c == '2' ? Side::Sell : Side::Buy;
+            this->errors[2][i] = field.empty() ? 400 : c == '1' || c == '2' ? 0 : 402;
+        }
+        for (size_t i = 0; i < n; i++) {
+            this->parsed[i] = parseQuantity(this->fields[3][i], this->quantities[i]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            int32_t quantity = this->parsed[i] ? this->quantities[i] : 1;
+            // a new order or an amend must leave something to trade, a cancel has no quantity
+            bool good = quantity % 10 == 0 && quantity > 0 && quantity < 1000;
+            this->errors[3][i] = this->fields[3][i].empty() ? 400 : good ? 0 : 403;
+        }
+        for (size_t i = 0; i < n; i++) {
+            this->parsed[i] = parsePrice(this->fields[4][i], this->prices[i]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            int64_t price = this->parsed[i] ? this->prices[i] : 0;
+            this->errors[4][i] = this->fields[4][i].empty() ? 400 : price > 0 ? 0 : 404;
+        }
+
+        // the first error from the left wins, the order type before everything
+        for (size_t i = 0; i < n; i++) {
+            uint16_t numbers = this->types[i] == OrderType::Cancel ? 0 : 0xFFFF; // a cancel has no quantity and price
+            uint16_t reason = 200;
+            reason = (this->errors[4][i] & numbers) != 0 ? this->errors[4][i] : reason;
+            reason = (this->errors[3][i] & numbers) != 0 ? this->errors[3][i] : reason;
+            reason = this->errors[2][i] != 0 ? this->errors[2][i] : reason;
+            reason = this->errors[1][i] != 0 ? this->errors[1][i] : reason;
+            reason = this->errors[0][i] != 0 ? this->errors[0][i] : reason;
+            reason = this->errors[5][i] != 0 ? this->errors[5][i] : reason;
+            this->reasons[i] = reason;
+        }
+    }
+
+    // the accepted order of row i, its client order id is interned
+    Order order(size_t i) const {
+        Order order(this->rows[i], clients.intern(this->fields[0][i]));
+        order.instrument = (uint16_t)this->instrument_ids[i];
+        order.side = this->sides[i];
+        order.type = this->types[i];
+        if (order.type != OrderType::Cancel) {
+            order.quantity = this->quantities[i];
+            order.price = this->prices[i];
+        }
+        return order;
+    }
+
+    // the text of rejected row i, echoed back in its report
+    RejectedRow rejectedRow(size_t i) const {
+        return { string(this->fields[0][i]), string(this->fields[1][i]), string(this->fields[2][i]),
+            string(this->fields[3][i]), string(this->fields[4][i]), string(this->fields[5][i]) };
+    }
+
+private:
+    uint16_t errors[COLUMNS][ROWS];
+    bool parsed[ROWS];
+};
+
+
+
+///////////////////////////////////////////// CSV CLASS /////////////////////////////////////////////////////////
+class CSV {
+public:
+    // Constructor
+    CSV(const string& filename) : filename(filename) {}
+
+    // threads that read a file, all the cores by default. With pinning they take the ingest cpus from first_cpu on
+    void setReaders(unsigned num_threads, unsigned first_cpu = 0) {
+        this->readers = max(1u, num_threads);
+        this->first_reader_cpu = first_cpu;
+    }
+
+    //----------------------------------- READ THE CSV FILE-----------------------------------------------------
+    // The file is mapped and cut into chunks of whole lines, the chunks are parsed on all the cores and
+    // published to the feed as they are done. The fields are scanned in place, nothing is allocated for a
+    // row except a new client order id
+    void readCsv(OrderFeed& feed) {
+        MappedFile inputFile(filename);
+        if (!inputFile.isOpen()) {
+            cerr << "Error opening file." << endl;
+            feed.finish();
+            return;
+        }
+        if (BinaryFile::isBinary(inputFile)) {
+            readBinary(inputFile, feed);
+            return;
+        }
+
+        const char* pos = inputFile.data();
+        const char* end = pos + inputFile.size();
+        if (end - pos >= 3 && memcmp(pos, "\xEF\xBB\xBF", 3) == 0) { // UTF-8 BOM
+            pos += 3;
+        }
+        pos = nextLine(pos, end); // Skip the first line (header)
+
+        // cut the rest into chunks that end after a new line
+        vector<OrderChunk*> chunks;
+        while (pos < end) {
+            OrderChunk& chunk = feed.addChunk();
+            chunk.begin = pos;
+            chunk.end = (size_t)(end - pos) > CHUNK_SIZE ? nextLine(pos + CHUNK_SIZE, end) : end;
+            chunks.push_back(&chunk);
+            pos = chunk.end;
+        }
+
+        unsigned num_threads = this->readers;
+        vector<thread> readers;
+
+        // the row numbers continue from chunk to chunk, so count the lines of every chunk first
+        vector<uint32_t> line_counts(chunks.size());
+        atomic<size_t> next_chunk(0);
+        for (unsigned t = 0; t < num_threads; t++) {
+            readers.emplace_back([&, t] {
+                pinThread(placement.ingest, this->first_reader_cpu + t);
+                for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+                    line_counts[i] = (uint32_t)count(chunks[i]->begin, chunks[i]->end, '\n');
+                }
+            });
+        }
+        for (thread& reader : readers) {
+            reader.join();
+        }
+        uint32_t row = 0;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            chunks[i]->first_row = row + 1;
+            row += line_counts[i];
+            chunks[i]->end_row = row + 1;
+        }
+
+        // parse the chunks
+        fillChunks(feed, chunks, [this](OrderChunk& chunk) { this->readChunk(chunk); }, this->readers, this->first_reader_cpu);
+        feed.finish();
+    }
+
+    //----------------------------------- READ A BINARY ORDER FILE-----------------------------------------------------
+    // same as the csv, but the records are already typed and validated. Instruments of the file that are not
+    // tradable here are rejected
+    void readBinary(const MappedFile& inputFile, OrderFeed& feed) {
+        BinaryFile orders(inputFile, BINARY_ORDERS_MAGIC, sizeof(BinaryOrder));
+        if (!orders.isValid()) {
+            cerr << "Invalid binary order file." << endl;
+            feed.finish();
+            return;
+        }
+
+        vector<uint32_t> instrument_ids;
+        for (string_view name : orders.instrumentNames()) {
+            uint32_t id;
+            instrument_ids.push_back(instruments.find(name, id) ? id : UINT32_MAX);
+        }
+
+        vector<OrderChunk*> chunks;
+        for (size_t first = 0; first < orders.count(); first += RECORDS_PER_CHUNK) {
+            size_t last = min(orders.count(), first + RECORDS_PER_CHUNK);
+            BinaryOrder record;
+            OrderChunk& chunk = feed.addChunk();
+            chunk.begin = orders.record(first);
+            chunk.end = orders.record(last);
+            memcpy(&record, chunk.begin, sizeof(record));
+            chunk.first_row = record.row;
+            memcpy(&record, orders.record(last - 1), sizeof(record));
+            chunk.end_row = record.row + 1;
+            chunks.push_back(&chunk);
+        }
+
+        fillChunks(feed, chunks, [&](OrderChunk& chunk) { this->readRecords(orders, instrument_ids, chunk); }, this->readers, this->first_reader_cpu);
+        feed.finish();
+    }
+
+    //----------------------------------- READ ORDERS AS THEY ARRIVE-----------------------------------------------------
+    // reads a pipe, stdin ("-") or a growing file without waiting for the end of it. Every order is handed to
+    // on_order in input order, and on_batch is called each time everything read so far is handed over.
+    // With follow the end of the file is not the end of the input, the file is polled for new lines.
+    // Reading starts at position (a restart from a snapshot) and position follows the rows handed over
+    bool readStream(bool follow, StreamPosition& position, const function<void(Order&)>& on_order, const function<void()>& on_batch) {
+        int fd = this->filename == "-" ? 0 : open(this->filename.c_str(), O_RDONLY | OPEN_BINARY);
+        if (fd == 0) {
+            setBinaryMode(0);
+        }
+        if (fd < 0) {
+            cerr << "Error opening file." << endl;
+            return false;
+        }
+
+        string pending; // read but not a whole line yet
+        vector<char> buffer(1 << 16);
+        unique_ptr<RowBlock> block(new RowBlock());
+        bool header = position.input_offset == 0;
+        if (!header && !skipInput(fd, position.input_offset, buffer)) {
+            cerr << "The input is shorter than the snapshot." << endl;
+            if (fd != 0) {
+                close(fd);
+            }
+            return false;
+        }
+        while (true) {
+            auto length = read(fd, buffer.data(), (unsigned)buffer.size());
+            if (length < 0) {
+                if (errno == EINTR) { // a signal, let the caller look at it
+                    on_batch();
+                    continue;
+                }
+                cerr << "Error reading file." << endl;
+                break;
+            }
+            if (length == 0) { // nothing more for now
+                if (!follow) {
+                    break;
+                }
+                on_batch();
+                if (!placement.busy_poll) {
+                    this_thread::sleep_for(chrono::milliseconds(10));
+                }
+                continue;
+            }
+
+            pending.append(buffer.data(), length);
+            size_t start = 0;
+            for (size_t line_end; (line_end = pending.find('\n', start)) != string::npos; start = line_end + 1) {
+                streamLine(string_view(pending).substr(start, line_end - start), header, position.rows, *block, on_order);
+            }
+            pending.erase(0, start);
+            position.input_offset += start;
+            on_batch();
+        }
+
+        if (!pending.empty()) { // last line without a new line
+            streamLine(pending, header, position.rows, *block, on_order);
+            position.input_offset += pending.size();
+            on_batch();
+        }
+        if (fd != 0) {
+            close(fd);
+        }
+        return true;
+    }
+
+    //----------------------------------- WRITE TO THE CSV FILE-----------------------------------------------------
+    // writes the reports of the sinks in order flow order, while they are being filled. quiet leaves out the
+    // message at the end, for runs inside another mode
+    // release_names: see ReportWriter::setReleaseNames
+    void writeToCsv(const vector<unique_ptr<ReportSink>>& sinks, const OrderFeed& feed, bool quiet = false, bool release_names = false) {
+        ReportWriter outputFile(filename, isBinaryName(filename));
+        if (release_names) {
+            outputFile.setReleaseNames();
+        }
+        if (!outputFile.isOpen()) {
+            cerr << "Error opening output file." << endl;
+            outputFile.writeMerged(sinks, feed); // nothing is written, but the sinks are still emptied
+            return;
+        }
+
+        outputFile.writeHeader();
+        outputFile.writeMerged(sinks, feed);
+
+        if (!quiet) {
+            cout << "CSV file created successfully." << endl;
+        }
+    }
+
+    //----------------------------------- WRITE THE MARKET DATA-----------------------------------------------------
+    void writeMarketData(const vector<unique_ptr<MarketDataSink>>& sinks, const OrderFeed& feed) {
+        ReportWriter outputFile(filename, isBinaryName(filename));
+        if (!outputFile.isOpen()) {
+            cerr << "Error opening market data file." << endl;
+            outputFile.writeMerged(sinks, feed);
+            return;
+        }
+        outputFile.writeMarketHeader();
+        outputFile.writeMerged(sinks, feed);
+    }
+
+private:
+    string filename;
+    unsigned readers = max(1u, thread::hardware_concurrency());
+    unsigned first_reader_cpu = 0;
+    InstrumentMatcher matcher;
+    static const size_t CHUNK_SIZE = 4 << 20; // bytes of input in a chunk
+    static const size_t RECORDS_PER_CHUNK = 64 * 1024; // binary records in a chunk
+
+    //----------------------------------- SKIP THE INPUT BEFORE A SNAPSHOT -----------------------------------------------------
+    // a file is seeked, a pipe is read and dropped. False if the input ends first
+    static bool skipInput(int fd, uint64_t length, vector<char>& buffer) {
+#ifdef _WIN32
+        int64_t file_size = _lseeki64(fd, 0, SEEK_END);
+        if (file_size >= 0) {
+            return (uint64_t)file_size >= length && _lseeki64(fd, (int64_t)length, SEEK_SET) >= 0;
+        }
+#else
+        off_t file_size = lseek(fd, 0, SEEK_END);
+        if (file_size >= 0) {
+            return (uint64_t)file_size >= length && lseek(fd, (off_t)length, SEEK_SET) >= 0;
+        }
+#endif
+        while (length != 0) {
+            auto read_length = read(fd, buffer.data(), (unsigned)min<uint64_t>(length, buffer.size()));
+            if (read_length < 0 && errno == EINTR) {
+                continue;
+            }
+            if (read_length <= 0) {
+                return false;
+            }
+            length -= read_length;
+        }
+        return true;
+    }
+
+    //----------------------------------- START OF THE NEXT LINE -----------------------------------------------------
+    static const char* nextLine(const char* pos, const char* end) {
+        if (pos == end) { // also an empty file, that maps to no memory
+            return end;
+        }
+        const char* line_end = (const char*)memchr(pos, '\n', end - pos);
+        return line_end == nullptr ? end : line_end + 1;
+    }
+
+    //----------------------------------- READ THE LINES OF A CHUNK -----------------------------------------------------
+    // the lines are validated a block at a time
+    void readChunk(OrderChunk& chunk) {
+        unique_ptr<RowBlock> block(new RowBlock());
+        auto accept = [&chunk](Order& order) { chunk.orders[order.instrument].push_back(order); };
+        STAT(LatencyHistogram& parse_latency = stats.thread().parse);
+        STAT(int64_t parse_start = LatencyHistogram::now());
+        const char* pos = chunk.begin;
+        uint32_t count = chunk.first_row;
+        while (pos < chunk.end) {
+            const char* line_end = (const char*)memchr(pos, '\n', chunk.end - pos);
+            if (line_end == nullptr) {
+                line_end = chunk.end;
+            }
+            const char* next = line_end == chunk.end ? chunk.end : line_end + 1;
+            if (line_end > pos && line_end[-1] == '\r') { // file saved with windows line endings
+                line_end--;
+            }
+            if (line_end != pos) {
+                block->add(string_view(pos, line_end - pos), count);
+                if (block->full()) {
+                    STAT(parse_latency.record((uint64_t)(LatencyHistogram::now() - parse_start) / RowBlock::ROWS));
+                    validateBlock(*block, accept, chunk.rejected_orders);
+                    STAT(parse_start = LatencyHistogram::now());
+                }
+            }
+            count++;
+            pos = next;
+        }
+        validateBlock(*block, accept, chunk.rejected_orders);
+        chunk.listTasks();
+    }
+
+    //----------------------------------- BINARY RECORDS OF ONE CHUNK -----------------------------------------------------
+    void readRecords(const BinaryFile& orders, const vector<uint32_t>& instrument_ids, OrderChunk& chunk) {
+        STAT(ThreadStats& local = stats.thread());
+        for (const char* pos = chunk.begin; pos < chunk.end; pos += sizeof(BinaryOrder)) {
+            BinaryOrder record;
+            memcpy(&record, pos, sizeof(record));
+            uint32_t client_offset = record.client;
+            string_view client = orders.text(client_offset);
+            uint32_t instrument = record.instrument < instrument_ids.size() ? instrument_ids[record.instrument] : UINT32_MAX;
+            bool accepted = record.reason == 200 && instrument != UINT32_MAX;
+            Order order(record.row, accepted ? clients.intern(client) : NO_CLIENT);
+            order.price = record.price;
+            order.quantity = record.quantity;
+            order.side = (Side)record.side;
+            order.type = (OrderType)record.type;
+            order.reason = record.reason;
+
+            if (order.reason == 200 && instrument == UINT32_MAX) { // not tradable here, the text is made from the fields
+                string_view name = record.instrument < instrument_ids.size() ? orders.instrumentNames()[record.instrument] : string_view();
+                order.reason = 401;
+                order.raw_row = rejected_rows.add({ string(client), string(name), string(1, (char)('0' + record.side)), to_string(record.quantity), formatPrice(record.price),
+                    record.type == (uint8_t)OrderType::New ? "" : record.type == (uint8_t)OrderType::Cancel ? "C" : "A" });
+            }
+            else if (order.reason != 200) {
+                uint32_t raw_offset = record.raw;
+                RejectedRow row;
+                row.client = string(client);
+                row.instrument = string(orders.text(raw_offset));
+                row.side = string(orders.text(raw_offset));
+                row.quantity = string(orders.text(raw_offset));
+                row.price = string(orders.text(raw_offset));
+                row.type = string(orders.text(raw_offset));
+                order.raw_row = rejected_rows.add(move(row));
+            }
+            STAT(LatencyHistogram::bump(local.rows));
+
+            if (order.reason != 200) {
+                order.exec_status = ExecStatus::Reject;
+                STAT(if (order.reason >= 400 && order.reason <= 404) LatencyHistogram::bump(local.rejects[order.reason - 400]));
+                chunk.rejected_orders.push_back(order);
+            }
+            else {
+                order.instrument = (uint16_t)instrument;
+                chunk.orders[instrument].push_back(order);
+            }
+        }
+        chunk.listTasks();
+    }
+
+    //----------------------------------- ONE LINE OF A STREAM -----------------------------------------------------
+    void streamLine(string_view line, bool& header, uint32_t& count, RowBlock& block, const function<void(Order&)>& on_order) {
+        if (!line.empty() && line.back() == '\r') { // windows line endings
+            line.remove_suffix(1);
+        }
+        if (header) { // Skip the first line (header)
+            header = false;
+            return;
+        }
+        count++;
+        if (!line.empty()) { // a block of one row, the order can't wait for more
+            STAT(int64_t parse_start = LatencyHistogram::now());
+            block.add(line, count);
+            STAT(stats.thread().parse.record((uint64_t)(LatencyHistogram::now() - parse_start)));
+            vector<Order> rejected_orders;
+            validateBlock(block, [&](Order& order) { on_order(order); }, rejected_orders);
+            if (!rejected_orders.empty()) {
+                on_order(rejected_orders[0]);
+            }
+        }
+    }
+
+    //----------------------------------- VALIDATE A BLOCK OF ROWS -----------------------------------------------------
+    // accept gets every accepted order. A rejected order gets the reject status, the reason and the raw text and
+    // is added to rejected_orders, the text of all the rejected rows of the block is stored under one lock
+    template <typename Accept>
+    void validateBlock(RowBlock& block, Accept accept, vector<Order>& rejected_orders) {
+        if (block.count == 0) {
+            return;
+        }
+        STAT(ThreadStats& local = stats.thread());
+        STAT(int64_t validate_start = LatencyHistogram::now());
+        block.validate(this->matcher);
+
+        size_t first_reject = rejected_orders.size();
+        vector<RejectedRow> rejected;
+        for (size_t i = 0; i < block.count; i++) {
+            if (block.reasons[i] == 200) {
+                Order order = block.order(i);
+                accept(order);
+            }
+            else {
+                Order order(block.rows[i], NO_CLIENT);
+                order.reason = block.reasons[i];
+                order.exec_status = ExecStatus::Reject;
+                rejected_orders.push_back(order);
+                rejected.push_back(block.rejectedRow(i));
+                STAT(LatencyHistogram::bump(local.rejects[order.reason - 400]));
+            }
+        }
+        if (!rejected.empty()) {
+            uint32_t indexes[RowBlock::ROWS];
+            rejected_rows.addAll(rejected, indexes);
+            for (size_t i = 0; i < rejected.size(); i++) {
+                rejected_orders[first_reject + i].raw_row = indexes[i];
+            }
+        }
+
+        STAT(LatencyHistogram::bump(local.rows, block.count));
+        STAT(local.validate.record((uint64_t)(LatencyHistogram::now() - validate_start) / block.count));
+        block.count = 0;
+    }
+};
+
+
+
+
+/////////////////////////////////////////////////// TRADE CLASS ////////////////////////////////////////////////////////////////
+class Trade {
+public:
+    OrderFeed feed; // orders from the reader, in input order
+    vector<unique_ptr<OrderBook>> books; // one per instrument
+    vector<unique_ptr<ReportSink>> report_sinks; // one per instrument, the last one is for the rejected orders
+    vector<unique_ptr<MarketDataSink>> market_sinks; // one per instrument when the market data is on
+    uint32_t rejected_task; // task id of the rejected orders, the ids below it are the instruments
+    uint32_t lane = 0; // batch lane of this trade, it picks the instrument stats
+
+    // Constructor, the instruments must be known
+    Trade() {
+        for (uint32_t i = 0; i < instruments.size(); i++) {
+            this->books.emplace_back(new OrderBook(instruments.name(i)));
+        }
+        for (size_t i = 0; i < instruments.size() + 1; i++) {
+            this->report_sinks.emplace_back(new ReportSink());
+        }
+        this->rejected_task = (uint32_t)instruments.size();
+        this->next_chunk.resize(instruments.size() + 1, 0);
+    }
+
+    //----------------------------------- START OVER FOR THE NEXT FILE----------------------------------
+    // every report is written and no task runs. The books, pools and sinks keep their memory. release_names
+    // gives back the client order ids of the orders left in the books, see ReportWriter::setReleaseNames
+    void reset(bool release_names = false) {
+        for (auto& book : this->books) {
+            if (release_names) {
+                book->forEachResting([](const Order& order) { clients.release(order.customer_id); });
+            }
+            book->clear();
+        }
+        this->feed.reset();
+        fill(this->next_chunk.begin(), this->next_chunk.end(), 0);
+        fill(this->tops.begin(), this->tops.end(), MarketUpdate());
+    }
+
+    //----------------------------------- TURN THE MARKET DATA ON----------------------------------
+    // before any order is matched
+    void enableMarketData() {
+        for (uint32_t i = 0; i < instruments.size(); i++) {
+            this->market_sinks.emplace_back(new MarketDataSink());
+            this->books[i]->buy_orders.trackChanges();
+            this->books[i]->sell_orders.trackChanges();
+        }
+        this->tops.assign(instruments.size() * 2, MarketUpdate());
+    }
+
+    //----------------------------------- PUBLISH THE CHANGES OF A BOOK----------------------------------
+    // after an order is matched: the levels it changed on both sides, then the tops that moved
+    void publishMarketData(OrderBook& order_book, uint16_t instrument, uint64_t order_flow, MarketDataSink& sink) {
+        this->publishDepth(order_book.buy_orders, Side::Buy, instrument, order_flow, sink);
+        this->publishDepth(order_book.sell_orders, Side::Sell, instrument, order_flow, sink);
+        this->publishTop(order_book.buy_orders, Side::Buy, instrument, order_flow, sink);
+        this->publishTop(order_book.sell_orders, Side::Sell, instrument, order_flow, sink);
+    }
+
+    //----------------------------------- ADD A REPORT TO THE SINK OF THE THREAD----------------------------------
+    void insertReport(ReportSink& sink, Order order, ExecStatus exec_status, uint64_t order_flow, int64_t timestamp) {
+        order.exec_status = exec_status;
+        order.timestamp = timestamp;
+        order.order_flow = order_flow;
+        sink.append(order);
+        // a row rejected by the validation may have no instrument, it is counted by the reader that validated it
+        STAT(if (exec_status != ExecStatus::Reject || order.raw_row == NO_RAW) LatencyHistogram::bump(stats.instrument(order.instrument, this->lane).reports[(int)exec_status]));
+    }
+
+    //----------------------------------- RUN A TASK OF THE WORKER POOL----------------------------------
+    // a task is an instrument or the rejected orders, it takes every chunk that is ready in input order. The pool
+    // never runs the same task on two workers at once, so the orders of an instrument are matched one by one
+    void executeTask(uint32_t task) {
+        size_t& index = this->next_chunk[task];
+        for (OrderChunk* chunk; (chunk = this->feed.get(index, task)) != nullptr; index++) {
+            if (task == this->rejected_task) {
+                addRejectedOrders(*chunk);
+            }
+            else {
+                executeOrders((uint16_t)task, *chunk);
+            }
+        }
+    }
+
+    //----------------------------------- EXECUTE THE ORDERS OF A CHUNK FOR A GIVEN FLOWER----------------------------------
+    // the chunk has orders of the flower, see OrderFeed::get
+    void executeOrders(uint16_t flower, OrderChunk& chunk) {
+        vector<Order>& flower_rows = chunk.orders[flower];
+        OrderBook& order_book = *this->books[flower];
+        ReportSink& sink = *this->report_sinks[flower];
+
+        // read the each element of flower orders
+        for (size_t i = 0; i < flower_rows.size(); i++) {
+            executeOrder(order_book, flower_rows[i], sink);
+            if (!this->market_sinks.empty()) {
+                publishMarketData(order_book, flower, flower_rows[i].order_flow, *this->market_sinks[flower]);
+            }
+        }
+        vector<Order>().swap(flower_rows); // only this task reads them, free the memory
+        this->feed.done(chunk);
+    }
+
+    //----------------------------------- MATCH ONE ORDER AGAINST THE BOOK----------------------------------
+    // whatever is not traded rests in the book
+    void executeOrder(OrderBook& order_book, Order order, ReportSink& sink) {
+        STAT(InstrumentStats& instrument_stats = stats.instrument(order.instrument, this->lane));
+        STAT(int64_t match_start = instrument_stats.match.start());
+        if (order.type == OrderType::Cancel) {
+            cancelOrder(order_book, order, sink);
+        }
+        else if (order.type == OrderType::Amend) {
+            amendOrder(order_book, order, sink);
+        }
+        else if (order.quantity <= 0) { // the validation rejects these, a binary order file can still have them
+            rejectRequest(order, sink, 403);
+        }
+        else if (order.isBuy()) { // buy order
+            placeOrder<Side::Buy>(order_book, order, sink);
+        }
+        else { // sell order
+            placeOrder<Side::Sell>(order_book, order, sink);
+        }
+        STAT(LatencyHistogram::bump(instrument_stats.orders));
+        STAT(instrument_stats.match.stop(match_start));
+        STAT(stats.noteBook(order.instrument, this->lane, order_book));
+    }
+
+    //----------------------------------- CANCEL AN OPEN ORDER----------------------------------
+    // the request names the order by its client order id and side, the order gets a Cancelled report with
+    // what was left of it
+    void cancelOrder(OrderBook& order_book, const Order& request, ReportSink& sink) {
+        Order* open = order_book.find(request.customer_id, request.side);
+        if (open == nullptr) {
+            rejectRequest(request, sink);
+            return;
+        }
+        Order cancelled = *open;
+        order_book.remove(cancelled);
+        this->insertReport(sink, cancelled, ExecStatus::Cancelled, request.order_flow, getReportTimestamp(request.order_flow));
+    }
+
+    //----------------------------------- AMEND AN OPEN ORDER----------------------------------
+    // the request has the new quantity and price. A smaller quantity at the same price keeps the place in the
+    // queue, anything else takes the order out and matches it again as if it just arrived. The validation
+    // rejects an amend to nothing, this keeps a binary order file from leaving an empty order in the book
+    void amendOrder(OrderBook& order_book, Order request, ReportSink& sink) {
+        if (request.quantity <= 0) {
+            rejectRequest(request, sink, 403);
+            return;
+        }
+        Order* open = order_book.find(request.customer_id, request.side);
+        if (open == nullptr) {
+            rejectRequest(request, sink);
+            return;
+        }
+        if (request.price == open->price && request.quantity <= open->quantity) {
+            order_book.setQuantity(*open, request.quantity);
+            this->insertReport(sink, *open, ExecStatus::Replaced, request.order_flow, getReportTimestamp(request.order_flow));
+            return;
+        }
+
+        Order amended = *open;
+        order_book.remove(amended);
+        amended.price = request.price;
+        amended.quantity = request.quantity;
+        amended.order_flow = request.order_flow;
+        this->insertReport(sink, amended, ExecStatus::Replaced, amended.order_flow, getReportTimestamp(amended.order_flow));
+        amended.order_flow++;
+        if (amended.isBuy()) {
+            placeOrder<Side::Buy>(order_book, amended, sink, false);
+        }
+        else {
+            placeOrder<Side::Sell>(order_book, amended, sink, false);
+        }
+    }
+
+    //----------------------------------- REJECT A REQUEST THE BOOK CAN'T TAKE----------------------------------
+    // there is no open order to change or the quantity leaves nothing to trade, the report echoes the typed fields of the request
+    void rejectRequest(Order request, ReportSink& sink, uint16_t reason = 405) {
+        request.reason = reason;
+        request.raw_row = NO_RAW;
+        this->insertReport(sink, request, ExecStatus::Reject, request.order_flow, getReportTimestamp(request.order_flow));
+        STAT(LatencyHistogram::bump(stats.thread().rejects[reason - 400]));
+    }
+
+    //----------------------------------- ADD A REJECTED ORDER TO A SINK----------------------------------
+    void addRejectedOrder(const Order& order, ReportSink& sink) {
+        this->insertReport(sink, order, ExecStatus::Reject, order.order_flow, getReportTimestamp(order.order_flow));
+    }
+
+    //----------------------------------- ADD THE REJECTED ORDERS OF A CHUNK TO THEIR SINK----------------------------------
+    // the chunk has rejected orders, see OrderFeed::get
+    void addRejectedOrders(OrderChunk& chunk) {
+        ReportSink& sink = *this->report_sinks[this->rejected_task];
+        for (const Order& order : chunk.rejected_orders) {
+            addRejectedOrder(order, sink);
+        }
+        vector<Order>().swap(chunk.rejected_orders);
+        this->feed.done(chunk);
+    }
+
+private:
+    vector<size_t> next_chunk; // next chunk of every task
+    vector<MarketUpdate> tops; // last published top of every instrument and side
+
+    template <typename BookSideT>
+    void publishDepth(BookSideT& side_book, Side side, uint16_t instrument, uint64_t order_flow, MarketDataSink& sink) {
+        vector<int64_t>& changes = side_book.takeChanges();
+        for (int64_t price : changes) {
+            const PriceLevel* level = side_book.level(price);
+            MarketUpdate update = {};
+            update.order_flow = order_flow;
+            update.price = price;
+            update.quantity = level != nullptr ? level->quantity : 0;
+            update.orders = level != nullptr ? level->count : 0;
+            update.instrument = instrument;
+            update.side = side;
+            update.kind = MarketUpdateKind::Depth;
+            sink.append(update);
+        }
+        changes.clear();
+    }
+
+    template <typename BookSideT>
+    void publishTop(BookSideT& side_book, Side side, uint16_t instrument, uint64_t order_flow, MarketDataSink& sink) {
+        const PriceLevel* best = side_book.bestLevel();
+        MarketUpdate top = {};
+        top.order_flow = order_flow;
+        top.price = best != nullptr ? side_book.bestPrice() : 0;
+        top.quantity = best != nullptr ? best->quantity : 0;
+        top.orders = best != nullptr ? best->count : 0;
+        top.instrument = instrument;
+        top.side = side;
+        top.kind = MarketUpdateKind::Top;
+
+        MarketUpdate& last = this->tops[instrument * 2 + (side == Side::Sell)];
+        if (top.price != last.price || top.quantity != last.quantity || top.orders != last.orders) {
+            sink.append(top);
+            last = top;
+        }
+    }
+
+    // the other side of the book, the one an incoming SIDE order trades with
+    template <Side SIDE>
+    static auto& otherSide(OrderBook& order_book) {
+        if constexpr (SIDE == Side::Buy) {
+            return order_book.sell_orders;
+        }
+        else {
+            return order_book.buy_orders;
+        }
+    }
+
+    // an incoming buy trades with sells priced at or below its limit, a sell with buys at or above it
+    template <Side SIDE>
+    static constexpr bool crosses(int64_t best_price, int64_t limit) {
+        return SIDE == Side::Buy ? best_price <= limit : best_price >= limit;
+    }
+
+    //------------------------------------------------------ MATCH AND REST AN ORDER---------------------------------------------------------
+    // whatever is not traded rests in the book
+    template <Side SIDE>
+    void placeOrder(OrderBook& order_book, Order& order, ReportSink& sink, bool acknowledge = true) {
+        this->matchOrder<SIDE>(order_book, order, sink, acknowledge);
+        if (order.quantity != 0) {
+            if constexpr (SIDE == Side::Buy) {
+                order_book.addBuyOrder(order); // decending order
+            }
+            else {
+                order_book.addSellOrder(order); // ascending order
+            }
+        }
+    }
+
+    //------------------------------------------------------ MATCH AN ORDER AGAINST THE OTHER SIDE---------------------------------------------------------
+    // one kernel for both sides, SIDE is the side of the incoming order. It trades with the oldest order at the
+    // best price of the other side while the prices cross, every trade at the resting price, and is left with
+    // the quantity to rest at its own price. Only an order that can't trade at all gets a New report.
+    // acknowledge false: an amended order that does not trade gets no New report, it already has a Replaced one
+    template <Side SIDE>
+    void matchOrder(OrderBook& order_book, Order& order, ReportSink& sink, bool acknowledge) {
+        auto& other_book = otherSide<SIDE>(order_book);
+        int64_t timestamp = getReportTimestamp(order.order_flow); // one clock reading for all the reports of the order
+
+        if (other_book.empty() || !crosses<SIDE>(other_book.bestPrice(), order.price)) { // nothing to trade with
+            if (acknowledge) {
+                this->insertReport(sink, order, ExecStatus::New, order.order_flow, timestamp);
+            }
+            return;
+        }
+
+        int64_t limit = order.price;
+        while (order.quantity != 0 && !other_book.empty() && crosses<SIDE>(other_book.bestPrice(), limit)) {
+            Order& resting = other_book.front(order_book.pool); // oldest order at the best price
+            int32_t resting_quantity = resting.quantity;
+            int32_t incoming_quantity = order.quantity;
+            order.price = other_book.bestPrice(); // the transaction price is the one of the order book
+
+            if (resting_quantity > incoming_quantity) { // the incoming order is filled, the rest of the resting one stays
+                Order traded = resting;
+                traded.quantity = incoming_quantity; // set the transaction quantity
+                this->insertReport(sink, order, ExecStatus::Fill, order.order_flow, timestamp);
+                order.order_flow++; // next sub-sequence for the next row of the same order
+                this->insertReport(sink, traded, ExecStatus::PFill, order.order_flow, timestamp);
+                order.order_flow++;
+                other_book.setQuantity(order_book.pool, other_book.frontIndex(), resting_quantity - incoming_quantity);
+                order.quantity = 0;
+            }
+            else { // the resting order is filled, and the incoming one too when the quantities are equal
+                order.quantity = resting_quantity; // set the transaction quantity
+                this->insertReport(sink, order, resting_quantity < incoming_quantity ? ExecStatus::PFill : ExecStatus::Fill, order.order_flow, timestamp);
+                order.order_flow++; // next sub-sequence for the next row of the same order
+                this->insertReport(sink, resting, ExecStatus::Fill, order.order_flow, timestamp);
+                order.order_flow++;
+                order_book.popFront(other_book); // remove the completed order from the order book
+                order.quantity = incoming_quantity - resting_quantity;
+            }
+        }
+        order.price = limit; // the remaining quantity rests at the price of the row
+    }
+
+};
+
+
+
+
+////////////////////////////////////////////// BATCH MODE /////////////////////////////////////////////////////////////////
+// a file is read on all cores, every instrument is matched as soon as its orders are read and the reports are
+// written while the matching runs. The engine stays up between files: it has a few lanes that each run a file
+// with their own Trade, reset and reused for the next file so the books, pools and sinks keep their memory, and
+// the matching tasks of all the lanes share one pool of workers
+class BatchEngine {
+public:
+    // Constructor, the instruments must be known
+    BatchEngine(unsigned lanes, unsigned num_workers, bool market_data) {
+        this->lane_tasks = (uint32_t)instruments.size() + 1;
+        for (unsigned lane = 0; lane < lanes; lane++) {
+            this->trades.emplace_back(new Trade());
+            this->trades.back()->lane = lane;
+            if (market_data) {
+                this->trades.back()->enableMarketData();
+            }
+            // a task is scheduled when the reader has orders for it
+            uint32_t first_task = lane * this->lane_tasks;
+            this->trades.back()->feed.setScheduler([this, first_task](uint32_t task) { this->pool->schedule(first_task + task); });
+        }
+        this->pool.reset(new WorkerPool(lanes * this->lane_tasks, num_workers, [this](uint32_t task) {
+            this->trades[task / this->lane_tasks]->executeTask(task % this->lane_tasks);
+        }));
+    }
+
+    ~BatchEngine() {
+        this->pool->stop();
+    }
+
+    //----------------------------------- ONE FILE ON A LANE----------------------------------
+    // returns when every report is written, readers is the number of threads that read the file. release_names
+    // when other lanes share the client order ids and rejected rows, see ReportWriter::setReleaseNames
+    void runFile(unsigned lane, const string& input, const string& output, const string& market_data, unsigned readers,
+        bool quiet = false, bool release_names = false) {
+        Trade& trade = *this->trades[lane];
+
+        // making the final csv file, the reports are written while the matching is running
+        CSV write_file(output);
+        thread writer([&] {
+            pinThread(placement.output, lane * 2);
+            write_file.writeToCsv(trade.report_sinks, trade.feed, quiet, release_names);
+        });
+        CSV market_file(market_data);
+        thread market_writer;
+        if (!market_data.empty()) { // the market data has its own writer, the same way
+            market_writer = thread([&] {
+                pinThread(placement.output, lane * 2 + 1);
+                market_file.writeMarketData(trade.market_sinks, trade.feed);
+            });
+        }
+
+        // read the csv file, the orders are split per flower and matched while the rest is read
+        CSV read_file(input);
+        read_file.setReaders(readers, lane * readers);
+        read_file.readCsv(trade.feed);
+
+        // wait until everything is written
+        writer.join();
+        if (market_writer.joinable()) {
+            market_writer.join();
+        }
+        this->pool->waitIdle(lane * this->lane_tasks, this->lane_tasks);
+        trade.reset(release_names);
+    }
+
+    //----------------------------------- MANY FILES----------------------------------
+    // jobs are { input, output }. Every lane takes the next file as soon as it is done with one, the biggest
+    // first so no big file is left for the end. A file gives back its client order ids and rejected rows as its
+    // reports are written, the other lanes go on using the tables meanwhile
+    void runFiles(vector<pair<string, string>> jobs) {
+        auto fileSize = [](const string& name) {
+            error_code error;
+            uintmax_t size = filesystem::file_size(name, error);
+            return error ? 0 : size;
+        };
+        stable_sort(jobs.begin(), jobs.end(), [&](const pair<string, string>& a, const pair<string, string>& b) {
+            return fileSize(a.first) > fileSize(b.first);
+        });
+
+        unsigned lanes = (unsigned)this->trades.size();
+        unsigned readers = max(1u, thread::hardware_concurrency() / lanes);
+        atomic<size_t> next_job{ 0 };
+        vector<thread> running;
+        for (unsigned lane = 0; lane < lanes; lane++) {
+            running.emplace_back([this, lane, &jobs, &next_job, readers] {
+                for (size_t job; (job = next_job.fetch_add(1)) < jobs.size();) {
+                    this->runFile(lane, jobs[job].first, jobs[job].second, "", readers, false, true);
+                }
+            });
+        }
+        for (thread& lane : running) {
+            lane.join();
+        }
+    }
+
+private:
+    vector<unique_ptr<Trade>> trades; // one per lane
+    uint32_t lane_tasks; // tasks of a lane: the instruments and the rejected orders
+    unique_ptr<WorkerPool> pool;
+};
+
+int runBatch(const string& input, const string& output, const string& market_data, unsigned num_workers, bool quiet = false) {
+    BatchEngine engine(1, num_workers, !market_data.empty());
+    engine.runFile(0, input, output, market_data, max(1u, thread::hardware_concurrency()), quiet);
+    return 0;
+}
+
+//----------------------------------- MANY FILES IN ONE RUN----------------------------------
+// inputs are files or directories (their .csv and .bin files), the report of input "day.csv" is
+// "output_dir/day_rep.csv"
+int runMultiBatch(const vector<string>& inputs, const string& output_dir, unsigned lanes, unsigned num_workers) {
+    vector<string> files;
+    for (const string& input : inputs) {
+        error_code error;
+        if (!filesystem::is_directory(input, error)) {
+            files.push_back(input);
+            continue;
+        }
+        vector<string> listed;
+        for (const filesystem::directory_entry& entry : filesystem::directory_iterator(input, error)) {
+            string extension = entry.path().extension().string();
+            if (entry.is_regular_file(error) && (extension == ".csv" || extension == ".bin")) {
+                listed.push_back(entry.path().string());
+            }
+        }
+        sort(listed.begin(), listed.end());
+        files.insert(files.end(), listed.begin(), listed.end());
+    }
+    if (files.empty()) {
+        cerr << "No input files." << endl;
+        return 1;
+    }
+
+    error_code error;
+    filesystem::create_directories(output_dir, error);
+    if (error) {
+        cerr << "Error creating output directory." << endl;
+        return 1;
+    }
+    vector<pair<string, string>> jobs;
+    set<string> outputs;
+    for (const string& file : files) {
+        string output = (filesystem::path(output_dir) / (filesystem::path(file).stem().string() + "_rep.csv")).string();
+        if (!outputs.insert(output).second) {
+            cerr << "Two inputs would write " << output << "." << endl;
+            return 1;
+        }
+        jobs.push_back({ file, output });
+    }
+
+    BatchEngine engine(min<unsigned>(lanes, (unsigned)jobs.size()), num_workers, false);
+    engine.runFiles(jobs);
+    return 0;
+}
+
+
+
+////////////////////////////////////////////// STREAMING MODE /////////////////////////////////////////////////////////////////
+// orders are matched one by one on this thread as they arrive, and the reports are written and flushed after
+// every read, so a report leaves within one read of its order. Only the books and the ids of live orders
+// are kept in memory. With a snapshot file the books are saved every snapshot_every rows and at the end, and
+// a run starts from the saved books: the input before the snapshot is skipped and the output is cut back to
+// the reports of that input, so a restart after a crash writes the same file a single run would
+int runStream(const string& input, const string& output, const string& market_data, bool follow, const string& snapshot_file, uint32_t snapshot_every) {
+    Trade trade;
+    if (!market_data.empty()) {
+        trade.enableMarketData();
+    }
+
+    StreamPosition position;
+    if (!snapshot_file.empty()) {
+        if (isBinaryName(output)) { // the text of a binary file is at its end, it can't be continued
+            cerr << "--snapshot needs a csv output." << endl;
+            return 1;
+        }
+        if (!loadSnapshot(snapshot_file, trade.books, position)) {
+            return 1;
+        }
+    }
+
+    ReportWriter outputFile(output, isBinaryName(output), position.output_offset);
+    if (!outputFile.isOpen()) {
+        cerr << (position.output_offset == 0 ? "Error opening output file." : "Error opening output file, or it is shorter than the snapshot.") << endl;
+        return 1;
+    }
+    if (position.output_offset == 0) {
+        outputFile.writeHeader();
+    }
+    outputFile.setReleaseNames();
+
+    // the market data file starts over on every run, after a restart with every level of the loaded books
+    unique_ptr<ReportWriter> marketFile;
+    MarketDataSink market_sink;
+    if (!market_data.empty()) {
+        marketFile.reset(new ReportWriter(market_data, isBinaryName(market_data)));
+        if (!marketFile->isOpen()) {
+            cerr << "Error opening market data file." << endl;
+            return 1;
+        }
+        marketFile->writeMarketHeader();
+        for (uint32_t i = 0; i < instruments.size(); i++) {
+            trade.publishMarketData(*trade.books[i], (uint16_t)i, makeOrderFlow(position.rows), market_sink);
+        }
+    }
+
+    // the reports of the input read so far must be on disk before a snapshot points after them
+    uint32_t saved_rows = position.rows;
+    auto save = [&] {
+        outputFile.sync();
+        position.output_offset = outputFile.size();
+        saved_rows = position.rows;
+        return saveSnapshot(snapshot_file, trade.books, position);
+    };
+
+    ReportSink sink; // reports of the current read
+    CSV read_file(input);
+    bool ok = read_file.readStream(follow, position,
+        [&](Order& order) {
+            if (order.exec_status == ExecStatus::Reject) {
+                trade.addRejectedOrder(order, sink);
+            }
+            else {
+                trade.executeOrder(*trade.books[order.instrument], order, sink);
+                if (marketFile) {
+                    trade.publishMarketData(*trade.books[order.instrument], order.instrument, order.order_flow, market_sink);
+                }
+            }
+        },
+        [&] {
+            while (const Order* next = sink.peek()) {
+                const Order report = *next;
+                sink.pop();
+                outputFile.writeReport(report);
+            }
+            outputFile.flush();
+            if (marketFile) {
+                while (const MarketUpdate* update = market_sink.peek()) {
+                    marketFile->writeUpdate(*update);
+                    market_sink.pop();
+                }
+                marketFile->flush();
+            }
+            if (!snapshot_file.empty() && position.rows - saved_rows >= snapshot_every) {
+                save();
+            }
+            STAT(stats.poll());
+        });
+    if (ok && !snapshot_file.empty() && !save()) {
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
+
+
+
+////////////////////////////////////////////// ORDER GENERATOR /////////////////////////////////////////////////////////////////
+// synthetic order flow in the input format, for benchmarks. The same settings and seed give the same file
+struct GeneratorSettings {
+    uint64_t orders = 1000000;
+    uint64_t seed = 1;
+    double skew = 1.0; // the i-th instrument gets weight 1/(i+1)^skew, 0 is uniform
+    int spread = 4; // ticks between the best passive buy and sell price
+    int depth = 20; // passive orders rest up to this many ticks behind the spread
+    double aggressive = 0.3; // share of orders priced through the other side
+    double reject = 0.01; // share of rows with an invalid field
+    double cancel = 0.0; // share of rows that cancel (2 in 3) or amend (1 in 3) a recent order
+    double reuse = 0.0; // share of new orders that take the client order id of a recent order, on either side
+};
+
+int generateOrders(const string& output, const GeneratorSettings& settings) {
+    static const int64_t TICK = PRICE_SCALE / 100;
+    ReportWriter outputFile(output);
+    if (!outputFile.isOpen()) {
+        cerr << "Error opening output file." << endl;
+        return 1;
+    }
+    outputFile.writeText("Client Order ID,Instrument,Side,Quantity,Price\n");
+
+    mt19937_64 random(settings.seed);
+    vector<double> weights;
+    for (uint32_t i = 0; i < instruments.size(); i++) {
+        weights.push_back(1.0 / pow(i + 1.0, settings.skew));
+    }
+    discrete_distribution<uint32_t> pick_instrument(weights.begin(), weights.end());
+    uniform_real_distribution<double> chance(0.0, 1.0);
+    uniform_int_distribution<int> pick_quantity(1, 99); // times 10
+    uniform_int_distribution<int> pick_depth(0, max(0, settings.depth));
+    uniform_int_distribution<int> pick_reject(400, 404);
+
+    int64_t half_spread = max(1, settings.spread / 2) * TICK;
+    int64_t lowest_mid = half_spread + (settings.depth + 1) * TICK; // passive prices stay above zero
+    vector<int64_t> mids(instruments.size(), 100 * PRICE_SCALE);
+
+    // recent new orders, a cancel or amend picks one of them and a cancelled one is not picked again. It may
+    // be filled already, then the request is rejected
+    struct RecentOrder {
+        uint64_t client;
+        uint32_t instrument;
+        bool buy;
+    };
+    vector<RecentOrder> recent;
+    const size_t RECENT_ORDERS = 4096;
+
+    char line[256];
+    for (uint64_t row = 0; row < settings.orders; row++) {
+        uint64_t client = row + 1;
+        uint32_t instrument;
+        bool buy;
+        OrderType type = OrderType::New;
+        if (!recent.empty() && chance(random) < settings.cancel) {
+            size_t pick = random() % recent.size();
+            client = recent[pick].client;
+            instrument = recent[pick].instrument;
+            buy = recent[pick].buy;
+            type = chance(random) < 2.0 / 3 ? OrderType::Cancel : OrderType::Amend;
+            if (type == OrderType::Cancel) {
+                recent[pick] = recent.back();
+                recent.pop_back();
+            }
+        }
+        else {
+            instrument = pick_instrument(random);
+            buy = chance(random) < 0.5;
+            if (!recent.empty() && chance(random) < settings.reuse) { // same book, so cancels have to tell them apart
+                size_t pick = random() % recent.size();
+                client = recent[pick].client;
+                instrument = recent[pick].instrument;
+            }
+            RecentOrder order = { client, instrument, buy };
+            if (recent.size() < RECENT_ORDERS) {
+                recent.push_back(order);
+            }
+            else {
+                recent[random() % RECENT_ORDERS] = order;
+            }
+        }
+
+        int64_t& mid = mids[instrument];
+        if (chance(random) < 0.1) { // the market drifts
+            mid = max(lowest_mid, mid + (chance(random) < 0.5 ? -TICK : TICK));
+        }
+
+        int64_t distance = chance(random) < settings.aggressive
+            ? -(int64_t)(pick_depth(random) / 4) * TICK // through the other side
+            : half_spread + pick_depth(random) * TICK; // resting behind the spread
+        int64_t price = buy ? mid - distance : mid + distance;
+
+        string_view instrument_text = instruments.name(instrument);
+        char side_text[] = { buy ? '1' : '2', 0 };
+        char quantity_text[16];
+        *to_chars(quantity_text, quantity_text + 15, pick_quantity(random) * 10).ptr = 0;
+        char price_text[32];
+        *writePrice(price_text, price) = 0;
+
+        if (type == OrderType::Cancel) {
+            quantity_text[0] = 0;
+            price_text[0] = 0;
+        }
+        else if (type == OrderType::New && chance(random) < settings.reject) { // one field is broken the way a client would break it
+            switch (pick_reject(random)) {
+            case 400: price_text[0] = 0; break;
+            case 401: instrument_text = "Daisy"; break;
+            case 402: side_text[0] = '3'; break;
+            case 403: strcpy(quantity_text, "15"); break;
+            case 404: strcpy(price_text, "-1"); break;
+            }
+        }
+
+        char* out = line;
+        *out++ = 'c';
+        out = to_chars(out, out + 20, client).ptr;
+        *out++ = ',';
+        memcpy(out, instrument_text.data(), min<size_t>(instrument_text.size(), 128));
+        out += min<size_t>(instrument_text.size(), 128);
+        out += sprintf(out, ",%s,%s,%s%s\n", side_text, quantity_text, price_text,
+            type == OrderType::Cancel ? ",C" : type == OrderType::Amend ? ",A" : "");
+        outputFile.writeText(string_view(line, out - line));
+    }
+    return 0;
+}
+
+
+
+////////////////////////////////////////////// BENCHMARK /////////////////////////////////////////////////////////////////
+// times the stages one after the other on the same input: ingest (read, split and validate on all cores),
+// matching (every instrument on this thread, every order timed) and writing the reports (to output, or only
+// formatted when output is empty). Prints one JSON line per run
+int runBenchmark(const string& input, const string& output, int runs) {
+    using clock = chrono::steady_clock;
+    for (int run = 1; run <= runs; run++) {
+        Trade trade;
+        trade.feed.setScheduler([](uint32_t) {}); // nothing runs while reading
+
+        auto ingest_start = clock::now();
+        CSV read_file(input);
+        read_file.readCsv(trade.feed);
+        auto ingest_end = clock::now();
+
+        // matching, chunk by chunk in input order for every instrument
+        size_t orders = 0;
+        size_t rejects = 0;
+        vector<uint32_t> latencies; // nanoseconds per order
+        auto match_start = clock::now();
+        for (uint32_t task = 0; task <= trade.rejected_task; task++) {
+            size_t index = 0;
+            for (OrderChunk* chunk; (chunk = trade.feed.get(index, task)) != nullptr; index++) {
+                if (task == trade.rejected_task) {
+                    rejects += chunk->rejected_orders.size();
+                    trade.addRejectedOrders(*chunk);
+                    continue;
+                }
+                vector<Order>& rows = chunk->orders[task];
+                for (Order& order : rows) {
+                    auto start = clock::now();
+                    trade.executeOrder(*trade.books[task], order, *trade.report_sinks[task]);
+                    latencies.push_back((uint32_t)min<int64_t>(UINT32_MAX, chrono::duration_cast<chrono::nanoseconds>(clock::now() - start).count()));
+                }
+                orders += rows.size();
+                vector<Order>().swap(rows);
+                trade.feed.done(*chunk);
+            }
+        }
+        auto match_end = clock::now();
+
+        ReportWriter outputFile(output, isBinaryName(output));
+        auto write_start = clock::now();
+        outputFile.writeHeader();
+        size_t reports = outputFile.writeMerged(trade.report_sinks, trade.feed);
+        auto write_end = clock::now();
+
+        auto seconds = [](clock::time_point from, clock::time_point to) { return chrono::duration<double>(to - from).count(); };
+        auto rate = [](size_t count, double time) { return time > 0 ? count / time : 0.0; };
+        auto percentile = [&](double p) {
+            return latencies.empty() ? 0u : latencies[min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+        };
+        sort(latencies.begin(), latencies.end());
+        double ingest = seconds(ingest_start, ingest_end);
+        double match = seconds(match_start, match_end);
+        double write = seconds(write_start, write_end);
+
+        printf("{\"run\":%d,\"orders\":%zu,\"rejects\":%zu,\"reports\":%zu,"
+            "\"ingest_seconds\":%.6f,\"ingest_rows_per_second\":%.0f,"
+            "\"match_seconds\":%.6f,\"match_orders_per_second\":%.0f,"
+            "\"write_seconds\":%.6f,\"write_reports_per_second\":%.0f,"
+            "\"latency_ns\":{\"p50\":%u,\"p90\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}\n",
+            run, orders, rejects, reports,
+            ingest, rate(orders + rejects, ingest),
+            match, rate(orders, match),
+            write, rate(reports, write),
+            percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), latencies.empty() ? 0u : latencies.back());
+        fflush(stdout);
+    }
+    return 0;
+}
+
+
+
+////////////////////////////////////////////// DIFFERENTIAL CHECK /////////////////////////////////////////////////////////////////
+// a plain matcher on one thread, written for clarity rather than speed: sorted maps of queues, a linear search
+// to take an order out, and the reports are kept in the order they are made. It follows the same rules as the
+// Trade class, so with logical time the engine must write exactly the same file
+class ReferenceMatcher {
+public:
+    vector<Order> reports; // in input order
+
+    ReferenceMatcher() : books(instruments.size()) {}
+
+    void add(Order order) {
+        if (order.exec_status == ExecStatus::Reject) { // rejected by the validation
+            this->report(order, ExecStatus::Reject, order.order_flow);
+            return;
+        }
+        Book& book = this->books[order.instrument];
+        if (order.type != OrderType::Cancel && order.quantity <= 0) { // nothing to trade
+            order.reason = 403;
+            order.raw_row = NO_RAW;
+            this->report(order, ExecStatus::Reject, order.order_flow);
+            return;
+        }
+        if (order.type == OrderType::New) {
+            this->match(book, order, true);
+            return;
+        }
+
+        auto open = book.open.find(openKey(order));
+        if (open == book.open.end()) { // no open order to change
+            order.reason = 405;
+            order.raw_row = NO_RAW;
+            this->report(order, ExecStatus::Reject, order.order_flow);
+            return;
+        }
+        OpenOrder newest = open->second.back();
+        Level& level = order.isBuy() ? book.buys[newest.price] : book.sells[newest.price];
+        auto resting = find_if(level.begin(), level.end(), [&](const Resting& r) { return r.serial == newest.serial; });
+        if (order.type == OrderType::Amend && order.price == resting->order.price && order.quantity <= resting->order.quantity) {
+            resting->order.quantity = order.quantity; // keeps its place
+            this->report(resting->order, ExecStatus::Replaced, order.order_flow);
+            return;
+        }
+
+        Order changed = resting->order;
+        level.erase(resting);
+        if (level.empty()) {
+            if (order.isBuy()) {
+                book.buys.erase(newest.price);
+            }
+            else {
+                book.sells.erase(newest.price);
+            }
+        }
+        this->close(book, changed, newest.serial);
+        if (order.type == OrderType::Cancel) {
+            this->report(changed, ExecStatus::Cancelled, order.order_flow);
+            return;
+        }
+        changed.price = order.price;
+        changed.quantity = order.quantity;
+        changed.order_flow = order.order_flow;
+        this->report(changed, ExecStatus::Replaced, changed.order_flow);
+        changed.order_flow++;
+        this->match(book, changed, false);
+    }
+
+private:
+    struct Resting {
+        Order order;
+        uint64_t serial; // tells apart orders that share a client order id
+    };
+    struct OpenOrder {
+        uint64_t serial;
+        int64_t price;
+    };
+    using Level = deque<Resting>;
+    struct Book {
+        map<int64_t, Level, greater<int64_t>> buys;
+        map<int64_t, Level> sells;
+        unordered_map<uint64_t, vector<OpenOrder>> open; // { client order id, side } -> its resting orders, oldest first
+    };
+    vector<Book> books;
+    uint64_t next_serial = 0;
+
+    static uint64_t openKey(const Order& order) {
+        return (uint64_t)order.customer_id << 8 | (uint8_t)order.side;
+    }
+
+    // a resting order left the book
+    void close(Book& book, const Order& order, uint64_t serial) {
+        auto open = book.open.find(openKey(order));
+        vector<OpenOrder>& orders = open->second;
+        orders.erase(find_if(orders.begin(), orders.end(), [&](const OpenOrder& o) { return o.serial == serial; }));
+        if (orders.empty()) {
+            book.open.erase(open);
+        }
+    }
+
+    void report(Order order, ExecStatus exec_status, uint64_t order_flow) {
+        order.exec_status = exec_status;
+        order.order_flow = order_flow;
+        order.timestamp = getReportTimestamp(order_flow);
+        this->reports.push_back(order);
+    }
+
+    // trades against the other side at the resting prices while the prices cross, what is left rests. Only an
+    // order that does not trade at all is acknowledged with New
+    void match(Book& book, Order order, bool acknowledge) {
+        bool traded = false;
+        int64_t limit = order.price;
+        while (order.quantity != 0) {
+            bool crosses = order.isBuy() ? !book.sells.empty() && book.sells.begin()->first <= limit
+                : !book.buys.empty() && book.buys.begin()->first >= limit;
+            if (!crosses) {
+                break;
+            }
+            int64_t price = order.isBuy() ? book.sells.begin()->first : book.buys.begin()->first;
+            Level& level = order.isBuy() ? book.sells.begin()->second : book.buys.begin()->second;
+            Resting& resting = level.front();
+            traded = true;
+
+            Order incoming = order;
+            incoming.price = price;
+            if (resting.order.quantity > order.quantity) {
+                Order part = resting.order;
+                part.quantity = order.quantity;
+                this->report(incoming, ExecStatus::Fill, order.order_flow++);
+                this->report(part, ExecStatus::PFill, order.order_flow++);
+                resting.order.quantity -= order.quantity;
+                order.quantity = 0;
+                break;
+            }
+            incoming.quantity = resting.order.quantity;
+            this->report(incoming, resting.order.quantity < order.quantity ? ExecStatus::PFill : ExecStatus::Fill, order.order_flow++);
+            this->report(resting.order, ExecStatus::Fill, order.order_flow++);
+            order.quantity -= resting.order.quantity;
+
+            this->close(book, resting.order, resting.serial);
+            level.pop_front();
+            if (level.empty()) {
+                if (order.isBuy()) {
+                    book.sells.erase(book.sells.begin());
+                }
+                else {
+                    book.buys.erase(book.buys.begin());
+                }
+            }
+        }
+        if (!traded && acknowledge) {
+            this->report(order, ExecStatus::New, order.order_flow);
+        }
+        if (order.quantity != 0) {
+            Resting resting = { order, this->next_serial++ };
+            if (order.isBuy()) {
+                book.buys[order.price].push_back(resting);
+            }
+            else {
+                book.sells[order.price].push_back(resting);
+            }
+            book.open[openKey(order)].push_back({ resting.serial, order.price });
+        }
+    }
+};
+
+// the line of the first difference between two files, 0 when they are the same
+size_t firstDifference(const string& first, const string& second) {
+    MappedFile a(first), b(second);
+    if (!a.isOpen() || !b.isOpen()) {
+        return 1;
+    }
+    size_t length = min(a.size(), b.size());
+    if (a.size() == b.size() && (length == 0 || memcmp(a.data(), b.data(), length) == 0)) {
+        return 0;
+    }
+    size_t at = 0;
+    while (at < length && a.data()[at] == b.data()[at]) {
+        at++;
+    }
+    return (size_t)count(a.data(), a.data() + at, '\n') + 1;
+}
+
+//----------------------------------- ENGINE AGAINST THE REFERENCE ON GENERATED INPUT----------------------------------
+// every round generates a file with the next seed, matches it with the reference, the batch engine on
+// num_workers threads and the stream mode, all with logical time, and compares the reports byte by byte.
+// The files are left in work_dir when a round differs
+int runVerify(const string& work_dir, GeneratorSettings settings, int rounds, unsigned num_workers) {
+    logical_time = true;
+    error_code error;
+    filesystem::create_directories(work_dir, error);
+    if (error) {
+        cerr << "Error creating work directory." << endl;
+        return 1;
+    }
+    auto path = [&](const char* name) { return (filesystem::path(work_dir) / name).string(); };
+    string input = path("verify_orders.csv");
+    string reference = path("verify_reference.csv");
+    string batch = path("verify_batch.csv");
+    string stream = path("verify_stream.csv");
+
+    for (int round = 0; round < rounds; round++, settings.seed++) {
+        if (generateOrders(input, settings) != 0) {
+            return 1;
+        }
+
+        ReferenceMatcher matcher;
+        StreamPosition position;
+        CSV read_file(input);
+        if (!read_file.readStream(false, position, [&](Order& order) { matcher.add(order); }, [] {})) {
+            return 1;
+        }
+        {
+            ReportWriter outputFile(reference);
+            outputFile.writeHeader();
+            for (const Order& report : matcher.reports) {
+                outputFile.writeReport(report);
+            }
+        }
+
+        // every run starts with no client order ids or rejected rows, the ids may differ but the text may not
+        auto run = [&](const function<int()>& engine) {
+            clients.clear();
+            rejected_rows.clear();
+            return engine();
+        };
+        if (run([&] { return runBatch(input, batch, "", num_workers, true); }) != 0
+            || run([&] { return runStream(input, stream, "", false, "", 0); }) != 0) {
+            return 1;
+        }
+        clients.clear();
+        rejected_rows.clear();
+
+        size_t batch_line = firstDifference(reference, batch);
+        size_t stream_line = firstDifference(reference, stream);
+        printf("round %d seed %llu: %llu orders, %zu reports, batch %s, stream %s\n", round + 1,
+            (unsigned long long)settings.seed, (unsigned long long)settings.orders, matcher.reports.size(),
+            batch_line == 0 ? "same" : ("differs at line " + to_string(batch_line)).c_str(),
+            stream_line == 0 ? "same" : ("differs at line " + to_string(stream_line)).c_str());
+        fflush(stdout);
+        if (batch_line != 0 || stream_line != 0) {
+            return 1;
+        }
+    }
+    for (const string& file : { input, reference, batch, stream }) {
+        filesystem::remove(file, error);
+    }
+    return 0;
+}
+
+
+
+////////////////////////////////////////////// CONVERTER /////////////////////////////////////////////////////////////////
+// csv orders to binary, binary orders to csv and binary reports to csv. The kind of the input is found from
+// its first bytes. Csv rows are validated on the way in, with the tradable instruments of this run
+int convertFile(const string& input, const string& output) {
+    MappedFile inputFile(input);
+    if (!inputFile.isOpen()) {
+        cerr << "Error opening file." << endl;
+        return 1;
+    }
+    ReportWriter outputFile(output);
+    if (!outputFile.isOpen()) {
+        cerr << "Error opening output file." << endl;
+        return 1;
+    }
+
+    if (!BinaryFile::isBinary(inputFile)) { // csv orders, read them like the engine does and keep the row order
+        OrderFeed feed;
+        feed.setScheduler([](uint32_t) {});
+        CSV read_file(input);
+        read_file.readCsv(feed);
+
+        outputFile.writeBinaryHeader(BINARY_ORDERS_MAGIC, sizeof(BinaryOrder));
+        size_t index = 0;
+        for (OrderChunk* chunk; (chunk = feed.get(index)) != nullptr; index++) {
+            vector<Order> rows = chunk->rejected_orders;
+            for (const vector<Order>& instrument_rows : chunk->orders) {
+                rows.insert(rows.end(), instrument_rows.begin(), instrument_rows.end());
+            }
+            sort(rows.begin(), rows.end(), [](const Order& a, const Order& b) { return a.order_id < b.order_id; });
+
+            for (const Order& order : rows) {
+                BinaryOrder record = {};
+                record.price = order.price;
+                record.quantity = order.quantity;
+                record.row = order.order_id;
+                record.instrument = order.instrument;
+                record.reason = order.reason;
+                record.side = (uint8_t)order.side;
+                record.type = (uint8_t)order.type;
+                if (order.exec_status == ExecStatus::Reject) {
+                    const RejectedRow& row = rejected_rows[order.raw_row];
+                    record.client = outputFile.addText(row.client);
+                    record.raw = outputFile.addText(row.instrument);
+                    outputFile.addText(row.side);
+                    outputFile.addText(row.quantity);
+                    outputFile.addText(row.price);
+                    outputFile.addText(row.type);
+                }
+                else {
+                    record.client = outputFile.addText(clients.name(order.customer_id));
+                }
+                outputFile.writeRecord(&record, sizeof(record));
+            }
+        }
+        return 0;
+    }
+
+    BinaryFile orders(inputFile, BINARY_ORDERS_MAGIC, sizeof(BinaryOrder));
+    if (orders.isValid()) { // binary orders, an empty line keeps the place of a row the binary file skipped
+        outputFile.writeText("Client Order ID,Instrument,Side,Quantity,Price\n");
+        uint32_t next_row = 1;
+        for (size_t i = 0; i < orders.count(); i++) {
+            BinaryOrder record;
+            memcpy(&record, orders.record(i), sizeof(record));
+            for (; next_row < record.row; next_row++) {
+                outputFile.writeText("\n");
+            }
+            next_row = record.row + 1;
+
+            uint32_t offset = record.client;
+            string line(orders.text(offset));
+            if (record.reason != 200) {
+                offset = record.raw;
+                for (int field = 0; field < 4; field++) {
+                    line += ',';
+                    line += orders.text(offset);
+                }
+                string_view type = orders.text(offset);
+                if (!type.empty()) {
+                    line += ',';
+                    line += type;
+                }
+            }
+            else {
+                line += ',';
+                line += record.instrument < orders.instrumentNames().size() ? orders.instrumentNames()[record.instrument] : string_view();
+                line += ',';
+                line += (char)('0' + record.side);
+                line += ',';
+                line += to_string(record.quantity);
+                line += ',';
+                line += formatPrice(record.price);
+                if (record.type != (uint8_t)OrderType::New) {
+                    line += record.type == (uint8_t)OrderType::Cancel ? ",C" : ",A";
+                }
+            }
+            line += '\n';
+            outputFile.writeText(line);
+        }
+        return 0;
+    }
+
+    BinaryFile reports(inputFile, BINARY_REPORTS_MAGIC, sizeof(BinaryReport));
+    if (reports.isValid()) {
+        outputFile.writeHeader();
+        for (size_t i = 0; i < reports.count(); i++) {
+            BinaryReport record;
+            memcpy(&record, reports.record(i), sizeof(record));
+            Order report(record.order_id, 0);
+            report.price = record.price;
+            report.timestamp = record.timestamp;
+            report.quantity = record.quantity;
+            report.reason = record.reason;
+            report.side = (Side)record.side;
+            report.exec_status = (ExecStatus)record.exec_status;
+
+            uint32_t offset = record.client;
+            string_view client = reports.text(offset);
+            if (report.exec_status == ExecStatus::Reject && record.raw != NO_RAW) {
+                offset = record.raw;
+                string_view raw[4];
+                for (string_view& field : raw) {
+                    field = reports.text(offset);
+                }
+                outputFile.writeRow(report, client, string_view(), raw);
+            }
+            else {
+                string_view instrument = record.instrument < reports.instrumentNames().size() ? reports.instrumentNames()[record.instrument] : string_view();
+                outputFile.writeRow(report, client, instrument, nullptr);
+            }
+        }
+        return 0;
+    }
+
+    cerr << "Invalid binary file." << endl;
+    return 1;
+}
+
+
+
+////////////////////////////////////////////// INSTRUMENT LIST /////////////////////////////////////////////////////////////////
+// one instrument per line, empty lines and lines starting with # are skipped
+bool loadInstruments(const string& filename) {
+    MappedFile inputFile(filename);
+    if (!inputFile.isOpen()) {
+        cerr << "Error opening instrument file." << endl;
+        return false;
+    }
+
+    string_view text(inputFile.data(), inputFile.size());
+    while (!text.empty()) {
+        size_t line_end = min(text.find('\n'), text.size());
+        string_view name = text.substr(0, line_end);
+        text.remove_prefix(min(line_end + 1, text.size()));
+
+        while (!name.empty() && (name.back() == '\r' || name.back() == ' ' || name.back() == '\t')) {
+            name.remove_suffix(1);
+        }
+        while (!name.empty() && (name.front() == ' ' || name.front() == '\t')) {
+            name.remove_prefix(1);
+        }
+        if (!name.empty() && name.front() != '#') {
+            instruments.intern(name);
+        }
+    }
+
+    if (instruments.size() > UINT16_MAX) { // Order keeps the instrument in 16 bits
+        cerr << "Too many instruments." << endl;
+        return false;
+    }
+    return true;
+}
+
+
+
+////////////////////////////////////////////// MAIN FUNCTION /////////////////////////////////////////////////////////////////
+// usage: project [options] [input.csv [output.csv]]
+//        project --multi [--lanes n] [options] output_dir input...        (files or directories, one report per file)
+//        project --stream [--follow] [--snapshot file [--snapshot-every rows]] [options] [input.csv|- [output.csv|-]]   (stdin and stdout by default)
+//        project --generate n [--seed n] [--skew x] [--spread ticks] [--depth ticks] [--aggressive x] [--reject x] [--cancel x] [--reuse x] [options] output.csv
+//        project --bench [--runs n] [options] input.csv [output.csv]
+//        project --convert [options] input output                  (csv orders <-> binary, binary reports -> csv)
+//        project --verify n [--rounds n] [--seed n] [generator options] [options] [work_dir]   (engine against a reference)
+// a binary order file is read like a csv, reports are written in binary when the output name ends in .bin
+// options: --instruments file   --threads n   --micros   --stats (dump the stats to stderr at exit, SIGUSR1 dumps them any time)
+//          --deterministic (transaction times from the input row instead of the clock, runs write the same bytes)
+//          --pin-ingest cpus   --pin-match cpus   --pin-output cpus (cpu lists like 0-3,8 for the readers, matching and writers)
+//          --busy-poll (waiting threads spin instead of sleeping)
+//          --market-data file (depth and top of book updates of batch and stream runs, binary when the name ends in .bin)
+int main(int argc, char* argv[]) {
+
+    bool stream = false;
+    bool follow = false;
+    string snapshot_file;
+    string market_data;
+    uint32_t snapshot_every = 1000000;
+    bool generate = false;
+    GeneratorSettings settings;
+    bool cancel_given = false;
+    bool reuse_given = false;
+    bool bench = false;
+    int runs = 1;
+    bool convert = false;
+    bool verify = false;
+    int rounds = 1;
+    bool multi = false;
+    unsigned lanes = max(1u, thread::hardware_concurrency());
+    [[maybe_unused]] bool dump_stats = false;
+    string instrument_file;
+    unsigned num_workers = max(1u, thread::hardware_concurrency());
+    vector<string> files;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--instruments" && i + 1 < argc) {
+            instrument_file = argv[++i];
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            num_workers = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--stream") {
+            stream = true;
+        }
+        else if (arg == "--generate" && i + 1 < argc) {
+            generate = true;
+            settings.orders = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--seed" && i + 1 < argc) {
+            settings.seed = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--skew" && i + 1 < argc) {
+            settings.skew = atof(argv[++i]);
+        }
+        else if (arg == "--spread" && i + 1 < argc) {
+            settings.spread = atoi(argv[++i]);
+        }
+        else if (arg == "--depth" && i + 1 < argc) {
+            settings.depth = atoi(argv[++i]);
+        }
+        else if (arg == "--aggressive" && i + 1 < argc) {
+            settings.aggressive = atof(argv[++i]);
+        }
+        else if (arg == "--reject" && i + 1 < argc) {
+            settings.reject = atof(argv[++i]);
+        }
+        else if (arg == "--cancel" && i + 1 < argc) {
+            settings.cancel = atof(argv[++i]);
+            cancel_given = true;
+        }
+        else if (arg == "--reuse" && i + 1 < argc) {
+            settings.reuse = atof(argv[++i]);
+            reuse_given = true;
+        }
+        else if (arg == "--convert") {
+            convert = true;
+        }
+        else if (arg == "--verify" && i + 1 < argc) {
+            verify = true;
+            settings.orders = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--rounds" && i + 1 < argc) {
+            rounds = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--deterministic") {
+            logical_time = true;
+        }
+        else if ((arg == "--pin-ingest" || arg == "--pin-match" || arg == "--pin-output") && i + 1 < argc) {
+            vector<unsigned>& cpus = arg == "--pin-ingest" ? placement.ingest : arg == "--pin-match" ? placement.match : placement.output;
+            if (!parseCpuList(argv[++i], cpus)) {
+                cerr << arg << " needs a list of cpus of this machine, like 0-3,8." << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--busy-poll") {
+            placement.busy_poll = true;
+        }
+        else if (arg == "--multi") {
+            multi = true;
+        }
+        else if (arg == "--lanes" && i + 1 < argc) {
+            lanes = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--bench") {
+            bench = true;
+        }
+        else if (arg == "--runs" && i + 1 < argc) {
+            runs = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--follow") {
+            follow = true;
+        }
+        else if (arg == "--market-data" && i + 1 < argc) {
+            market_data = argv[++i];
+        }
+        else if (arg == "--snapshot" && i + 1 < argc) {
+            snapshot_file = argv[++i];
+        }
+        else if (arg == "--snapshot-every" && i + 1 < argc) {
+            snapshot_every = (uint32_t)max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--stats") {
+            dump_stats = true;
+        }
+        else if (arg == "--micros") {
+            timestamp_digits = 6;
+        }
+        else {
+            files.push_back(arg);
+        }
+    }
+
+    chooseTimestampClock();
+
+    if (!instrument_file.empty()) {
+        if (!loadInstruments(instrument_file)) {
+            return 1;
+        }
+    }
+    else { // the tradable flowers, interned in this order so the ids are 0..4
+        string flowers[] = { "Rose", "Lavender", "Lotus", "Tulip", "Orchid" };
+        for (const string& flower : flowers) {
+            instruments.intern(flower);
+        }
+    }
+
+    STAT(stats.setInstruments(instruments.size(), multi ? lanes : 1));
+    STAT(stats.installSignal());
+
+    if (!snapshot_file.empty() && !stream) {
+        cerr << "--snapshot works with --stream." << endl;
+        return 1;
+    }
+    if (!market_data.empty() && multi) {
+        cerr << "--market-data works with a single file." << endl;
+        return 1;
+    }
+
+    int result;
+    if (stream || bench) { // this thread matches
+        pinThread(placement.match, 0);
+    }
+    if (stream) {
+        result = runStream(files.size() > 0 ? files[0] : "-", files.size() > 1 ? files[1] : "-", market_data, follow, snapshot_file, snapshot_every);
+    }
+    else if (generate) {
+        result = generateOrders(files.size() > 0 ? files[0] : "-", settings);
+    }
+    else if (convert) {
+        if (files.size() < 2) {
+            cerr << "--convert needs an input and an output file." << endl;
+            return 1;
+        }
+        result = convertFile(files[0], files[1]);
+    }
+    else if (verify) {
+        // by default the checked flow cancels and amends, and reuses client order ids on both sides
+        settings.cancel = cancel_given ? settings.cancel : 0.2;
+        settings.reuse = reuse_given ? settings.reuse : 0.1;
+        result = runVerify(files.size() > 0 ? files[0] : filesystem::temp_directory_path().string(), settings, rounds, num_workers);
+    }
+    else if (multi) {
+        if (files.size() < 2) {
+            cerr << "--multi needs an output directory and input files." << endl;
+            return 1;
+        }
+        result = runMultiBatch(vector<string>(files.begin() + 1, files.end()), files[0], lanes, num_workers);
+    }
+    else if (bench) {
+        result = runBenchmark(files.size() > 0 ? files[0] : "ex2.csv", files.size() > 1 ? files[1] : "", runs);
+    }
+    else {
+        result = runBatch(files.size() > 0 ? files[0] : "ex2.csv", files.size() > 1 ? files[1] : "execution_rep.csv", market_data, num_workers);
+    }
+
+    STAT(if (dump_stats) stats.dump(cerr));
+    return result;
 }